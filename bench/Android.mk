@@ -0,0 +1,41 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+include external/ffmpeg/android/ffmpeg.mk
+
+LOCAL_SRC_FILES := \
+	ffmpeg_bench.cpp \
+	malloc_count.cpp
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../libstagefright/FFmpegExtractor \
+	$(TOP)/frameworks/native/include/media/openmax \
+	$(TOP)/frameworks/av/include \
+	$(TOP)/frameworks/av/media/libstagefright
+
+LOCAL_SHARED_LIBRARIES := \
+	libutils          \
+	libcutils         \
+	libdl             \
+	libavcodec        \
+	libavformat       \
+	libavutil         \
+	libffmpeg_utils   \
+	libFFmpegExtractor \
+	libstagefright    \
+	libstagefright_foundation
+
+# A target executable, run over adb. There is no host variant: the
+# extractor needs libstagefright, libstagefright_foundation and the ffmpeg
+# libraries of external/ffmpeg, and none of them builds for the host.
+LOCAL_MODULE := ffmpeg_bench
+
+LOCAL_MODULE_TAGS := optional
+
+# malloc_count.cpp interposes the allocator of the libraries we load
+LOCAL_LDFLAGS += -Wl,--export-dynamic
+
+LOCAL_CFLAGS += -D__STDC_CONSTANT_MACROS=1 -D__STDINT_LIMITS=1
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,921 @@
+/*
+ * Copyright (C) 2015 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmarks for FFmpegExtractor over a corpus of media files, made of
+ * all the files found under the given paths. Results are printed on
+ * stdout as JSON.
+ *
+ * demux (default): every file is sniffed, opened and read to the end on
+ * all tracks, the way a player would; throughput per file and container.
+ *     ffmpeg_bench /sdcard/corpus > /sdcard/demux.json
+ * setprop media.ffmpeg.bufpool 0 gives the same without the MediaBuffer
+ * pool of FFmpegSource.
+ *
+ * demux and startup print the media.ffmpeg.<role>.<prio|cpus|threads>
+ * thread policy they ran with, null where the built-in default applied.
+ * -p sets one for the run, e.g. to compare the reader on other cores:
+ *     ffmpeg_bench -p reader.cpus=0x0f -p reader.prio=-4 /sdcard/corpus
+ *
+ * startup: every file is sniffed, opened, has the first packet of each
+ * track read and is closed again, -n times with a cold page cache and as
+ * many with a warm one; percentiles of each step per file.
+ *     ffmpeg_bench -m startup -n 50 /sdcard/corpus > /sdcard/startup.json
+ *
+ * sniff: SniffFFMPEG alone on every file, including the ones the stock
+ * extractors handle, -n times; time, cpu time (mostly the decoding done
+ * by avformat_find_stream_info), bytes read and allocations per file,
+ * and totals per container and outcome.
+ *     ffmpeg_bench -m sniff /sdcard/corpus > /sdcard/sniff.json
+ * setprop media.ffmpeg.sniff.header 0 gives the same with stream info
+ * probed for every file, even when its header names all the codecs.
+ *
+ * startcode: the start code scanners of the split helpers over the first
+ * STARTCODE_MAX_SIZE bytes of every file, -n times: find_start_code()
+ * (SSE2, NEON or word at a time, whatever this build has), the word at a
+ * time loop and the byte loop it replaced; median time and MB/s of each.
+ *     ffmpeg_bench -m startcode /sdcard/corpus/*.h264 > /sdcard/startcode.json
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ffmpeg_bench"
+#include <utils/Log.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <utils/KeyedVector.h>
+#include <utils/SortedVector.h>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/foundation/AString.h>
+#include <media/stagefright/DataSource.h>
+#include <media/stagefright/FileSource.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+
+#include "FFmpegExtractor.h"
+#include "malloc_count.h"
+
+using namespace android;
+
+#define DEFAULT_ITERATIONS 20
+#define MAX_TRACKS 4
+#define STARTCODE_MAX_SIZE (8 * 1024 * 1024)
+
+#if defined(__SSE2__)
+#define FIND_START_CODE_PATH "sse2"
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define FIND_START_CODE_PATH "neon"
+#else
+#define FIND_START_CODE_PATH "word"
+#endif
+
+/* counts what the sniffer reads from the wrapped source */
+struct CountingDataSource : public DataSource {
+    CountingDataSource(const sp<DataSource> &source)
+        : mSource(source),
+          mBytesRead(0),
+          mReads(0) {
+    }
+
+    virtual status_t initCheck() const {
+        return mSource->initCheck();
+    }
+
+    virtual ssize_t readAt(off64_t offset, void *data, size_t size) {
+        ssize_t n = mSource->readAt(offset, data, size);
+        if (n > 0) {
+            __sync_fetch_and_add(&mBytesRead, (int64_t)n);
+        }
+        __sync_fetch_and_add(&mReads, 1);
+        return n;
+    }
+
+    virtual status_t getSize(off64_t *size) {
+        return mSource->getSize(size);
+    }
+
+    virtual uint32_t flags() {
+        return mSource->flags();
+    }
+
+    virtual String8 getUri() {
+        return mSource->getUri();
+    }
+
+    int64_t bytesRead() {
+        return __sync_fetch_and_add(&mBytesRead, 0);
+    }
+
+    int64_t reads() {
+        return __sync_fetch_and_add(&mReads, 0);
+    }
+
+private:
+    sp<DataSource> mSource;
+    int64_t mBytesRead;
+    int64_t mReads;
+
+    DISALLOW_EVIL_CONSTRUCTORS(CountingDataSource);
+};
+
+struct DemuxStats {
+    int files;
+    int64_t packets;
+    int64_t bytes;
+    int64_t wallUs;
+    int64_t cpuUs;
+    int64_t allocs;
+    size_t peakQueuedBytes;
+};
+
+static int64_t wallTimeUs()
+{
+    return systemTime(SYSTEM_TIME_MONOTONIC) / 1000;
+}
+
+static int64_t cpuTimeUs(clockid_t clock = CLOCK_PROCESS_CPUTIME_ID)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void collectFiles(const char *path, SortedVector<String8> *files)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "cannot stat %s\n", path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        files->add(String8(path));
+        return;
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        String8 child(path);
+        child.appendPath(entry->d_name);
+        collectFiles(child.string(), files);
+    }
+    closedir(dir);
+}
+
+static void printJsonString(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+static const char *kThreadRoles[] = { "reader", "vdec", "adec" };
+static const char *kThreadPolicyFields[] = { "prio", "cpus", "threads" };
+
+/* set media.ffmpeg.<role>.<field> from "role.field=value" */
+static bool setThreadPolicy(const char *arg)
+{
+    char key[PROPERTY_KEY_MAX];
+    const char *value = strchr(arg, '=');
+
+    if (!value || value == arg
+            || snprintf(key, sizeof(key), "media.ffmpeg.%.*s",
+                    (int)(value - arg), arg) >= (int)sizeof(key)) {
+        return false;
+    }
+    if (property_set(key, value + 1) < 0) {
+        fprintf(stderr, "cannot set %s\n", key);
+        return false;
+    }
+    return true;
+}
+
+static void printThreadPolicy()
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    size_t i, j;
+
+    printf("\"thread_policy\": {");
+    for (i = 0; i < FF_ARRAY_ELEMS(kThreadRoles); i++) {
+        printf("%s\"%s\": {", i ? ", " : "", kThreadRoles[i]);
+        for (j = 0; j < FF_ARRAY_ELEMS(kThreadPolicyFields); j++) {
+            snprintf(key, sizeof(key), "media.ffmpeg.%s.%s",
+                    kThreadRoles[i], kThreadPolicyFields[j]);
+            printf("%s\"%s\": ", j ? ", " : "", kThreadPolicyFields[j]);
+            if (property_get(key, value, NULL) > 0) {
+                printJsonString(value);
+            } else {
+                printf("null");
+            }
+        }
+        printf("}");
+    }
+    printf("}");
+}
+
+static void printStats(const DemuxStats &stats)
+{
+    double secs = stats.wallUs / 1E6;
+
+    printf("\"packets\": %lld, \"bytes\": %lld, \"wall_us\": %lld, \"cpu_us\": %lld, "
+            "\"packets_per_s\": %.1f, \"mb_per_s\": %.2f, "
+            "\"allocs_per_packet\": %.2f, \"peak_queued_bytes\": %zu",
+            (long long)stats.packets, (long long)stats.bytes,
+            (long long)stats.wallUs, (long long)stats.cpuUs,
+            secs > 0 ? stats.packets / secs : 0.0,
+            secs > 0 ? stats.bytes / secs / (1024 * 1024) : 0.0,
+            stats.packets > 0 ? (double)stats.allocs / stats.packets : 0.0,
+            stats.peakQueuedBytes);
+}
+
+/* open the file the way the framework does: sniff, then create */
+static sp<MediaExtractor> openExtractor(const char *path, String8 *container)
+{
+    sp<DataSource> source = new FileSource(path);
+    sp<AMessage> meta;
+    float confidence = 0.0f;
+
+    if (source->initCheck() != OK) {
+        return NULL;
+    }
+    if (!SniffFFMPEG(source, container, &confidence, &meta)) {
+        return NULL;
+    }
+    return CreateFFmpegExtractor(source, container->string(), meta);
+}
+
+/* read all tracks to the end, always from the one that lags behind */
+static status_t demux(const sp<MediaExtractor> &extractor, DemuxStats *stats)
+{
+    Vector<sp<MediaSource> > tracks;
+    Vector<int64_t> lastTimeUs;
+    size_t i, n = extractor->countTracks();
+    int64_t startUs, startCpuUs, startAllocs;
+
+    for (i = 0; i < n; i++) {
+        sp<MediaSource> track = extractor->getTrack(i);
+        if (track == NULL || track->start() != OK) {
+            continue;
+        }
+        tracks.push(track);
+        lastTimeUs.push(0);
+    }
+    if (tracks.isEmpty()) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    startUs = wallTimeUs();
+    startCpuUs = cpuTimeUs();
+    startAllocs = malloc_count();
+
+    while (!tracks.isEmpty()) {
+        size_t next = 0;
+        MediaBuffer *buffer = NULL;
+        int64_t timeUs;
+        status_t err;
+
+        for (i = 1; i < tracks.size(); i++) {
+            if (lastTimeUs[i] < lastTimeUs[next]) {
+                next = i;
+            }
+        }
+
+        err = tracks[next]->read(&buffer);
+        if (err == INFO_FORMAT_CHANGED) {
+            continue;
+        }
+        if (err != OK) {
+            tracks[next]->stop();
+            tracks.removeAt(next);
+            lastTimeUs.removeAt(next);
+            continue;
+        }
+
+        stats->packets++;
+        stats->bytes += buffer->range_length();
+        if (buffer->meta_data()->findInt64(kKeyTime, &timeUs)) {
+            lastTimeUs.editItemAt(next) = timeUs;
+        }
+        buffer->release();
+    }
+
+    stats->wallUs += wallTimeUs() - startUs;
+    stats->cpuUs += cpuTimeUs() - startCpuUs;
+    stats->allocs += malloc_count() - startAllocs;
+    stats->peakQueuedBytes = static_cast<FFmpegExtractor *>(
+            extractor.get())->peakQueuedBytes();
+    return OK;
+}
+
+static void runDemux(const SortedVector<String8> &files)
+{
+    KeyedVector<String8, DemuxStats> containers;
+    char value[PROPERTY_VALUE_MAX];
+    size_t i;
+
+    property_get("media.ffmpeg.bufpool", value, "1");
+    printf("{\n\"benchmark\": \"demux\",\n\"bufpool\": %s,\n",
+            atoi(value) ? "true" : "false");
+    printThreadPolicy();
+    printf(",\n\"files\": [\n");
+    for (i = 0; i < files.size(); i++) {
+        const char *path = files[i].string();
+        String8 container;
+        DemuxStats stats;
+        status_t err = ERROR_UNSUPPORTED;
+
+        memset(&stats, 0, sizeof(stats));
+        sp<MediaExtractor> extractor = openExtractor(path, &container);
+        if (extractor != NULL) {
+            err = demux(extractor, &stats);
+        }
+        extractor.clear();
+
+        printf("  {\"file\": ");
+        printJsonString(path);
+        if (err != OK) {
+            printf(", \"error\": %d}%s\n", err, i + 1 < files.size() ? "," : "");
+            continue;
+        }
+        printf(", \"container\": ");
+        printJsonString(container.string());
+        printf(", ");
+        printStats(stats);
+        printf("}%s\n", i + 1 < files.size() ? "," : "");
+
+        ssize_t index = containers.indexOfKey(container);
+        if (index < 0) {
+            DemuxStats zero;
+            memset(&zero, 0, sizeof(zero));
+            index = containers.add(container, zero);
+        }
+        DemuxStats &total = containers.editValueAt(index);
+        total.files++;
+        total.packets += stats.packets;
+        total.bytes += stats.bytes;
+        total.wallUs += stats.wallUs;
+        total.cpuUs += stats.cpuUs;
+        total.allocs += stats.allocs;
+        if (stats.peakQueuedBytes > total.peakQueuedBytes) {
+            total.peakQueuedBytes = stats.peakQueuedBytes;
+        }
+    }
+    printf("],\n\"containers\": {\n");
+    for (i = 0; i < containers.size(); i++) {
+        printf("  ");
+        printJsonString(containers.keyAt(i).string());
+        printf(": {\"files\": %d, ", containers.valueAt(i).files);
+        printStats(containers.valueAt(i));
+        printf("}%s\n", i + 1 < containers.size() ? "," : "");
+    }
+    printf("}\n}\n");
+
+}
+
+struct StartupTimes {
+    Vector<int64_t> sniffUs;
+    Vector<int64_t> openUs;
+    Vector<int64_t> firstReadUs[MAX_TRACKS];
+    Vector<int64_t> teardownUs;
+    Vector<int64_t> totalUs;
+};
+
+/* evict the file from the page cache, as far as we are allowed to */
+static void dropPageCache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0) {
+        sync();
+        write(fd, "1", 1);
+        close(fd);
+    }
+}
+
+/* time one open-to-first-packet cycle, from sniff to teardown */
+static status_t startupOnce(const char *path, StartupTimes *times,
+        size_t *trackCount, String8 *container)
+{
+    sp<DataSource> source = new FileSource(path);
+    sp<AMessage> meta;
+    sp<MediaExtractor> extractor;
+    Vector<sp<MediaSource> > tracks;
+    float confidence = 0.0f;
+    int64_t startUs, stepUs, nowUs;
+    size_t i, n;
+
+    if (source->initCheck() != OK) {
+        return ERROR_IO;
+    }
+
+    startUs = stepUs = wallTimeUs();
+    if (!SniffFFMPEG(source, container, &confidence, &meta)) {
+        return ERROR_UNSUPPORTED;
+    }
+    nowUs = wallTimeUs();
+    times->sniffUs.push(nowUs - stepUs);
+
+    stepUs = nowUs;
+    extractor = CreateFFmpegExtractor(source, container->string(), meta);
+    if (extractor == NULL || extractor->countTracks() == 0) {
+        return ERROR_UNSUPPORTED;
+    }
+    nowUs = wallTimeUs();
+    times->openUs.push(nowUs - stepUs);
+
+    n = extractor->countTracks();
+    if (n > MAX_TRACKS) {
+        n = MAX_TRACKS;
+    }
+    for (i = 0; i < n; i++) {
+        sp<MediaSource> track = extractor->getTrack(i);
+        MediaBuffer *buffer = NULL;
+        status_t err;
+
+        stepUs = wallTimeUs();
+        if (track == NULL || track->start() != OK) {
+            return ERROR_UNSUPPORTED;
+        }
+        do {
+            err = track->read(&buffer);
+        } while (err == INFO_FORMAT_CHANGED);
+        if (err != OK) {
+            return err;
+        }
+        buffer->release();
+        times->firstReadUs[i].push(wallTimeUs() - stepUs);
+        tracks.push(track);
+    }
+    *trackCount = n;
+
+    /* the sources hold the extractor, the last reference goes last */
+    stepUs = wallTimeUs();
+    for (i = 0; i < tracks.size(); i++) {
+        tracks[i]->stop();
+    }
+    tracks.clear();
+    extractor.clear();
+    nowUs = wallTimeUs();
+    times->teardownUs.push(nowUs - stepUs);
+    times->totalUs.push(nowUs - startUs);
+
+    return OK;
+}
+
+static int compareTimes(const int64_t *a, const int64_t *b)
+{
+    return *a < *b ? -1 : *a > *b;
+}
+
+static void printPercentiles(const char *name, Vector<int64_t> &samples)
+{
+    size_t n = samples.size();
+
+    if (n == 0) {
+        return;
+    }
+    samples.sort(compareTimes);
+    printf("\"%s\": {\"min\": %lld, \"p50\": %lld, \"p90\": %lld, "
+            "\"p99\": %lld, \"max\": %lld}", name,
+            (long long)samples[0],
+            (long long)samples[(n - 1) * 50 / 100],
+            (long long)samples[(n - 1) * 90 / 100],
+            (long long)samples[(n - 1) * 99 / 100],
+            (long long)samples[n - 1]);
+}
+
+static void printStartupTimes(StartupTimes &times, size_t trackCount)
+{
+    char name[32];
+    size_t i;
+
+    printf("{");
+    printPercentiles("sniff_us", times.sniffUs);
+    printf(", ");
+    printPercentiles("open_us", times.openUs);
+    for (i = 0; i < trackCount; i++) {
+        snprintf(name, sizeof(name), "track%zu_first_read_us", i);
+        printf(", ");
+        printPercentiles(name, times.firstReadUs[i]);
+    }
+    printf(", ");
+    printPercentiles("teardown_us", times.teardownUs);
+    printf(", ");
+    printPercentiles("total_us", times.totalUs);
+    printf("}");
+}
+
+static void runStartup(const SortedVector<String8> &files, int iterations)
+{
+    size_t i;
+    int j;
+
+    printf("{\n\"benchmark\": \"startup\",\n\"iterations\": %d,\n", iterations);
+    printThreadPolicy();
+    printf(",\n\"files\": [\n");
+    for (i = 0; i < files.size(); i++) {
+        const char *path = files[i].string();
+        StartupTimes cold, warm;
+        String8 container;
+        size_t trackCount = 0;
+        status_t err = OK;
+
+        for (j = 0; j < iterations && err == OK; j++) {
+            dropPageCache(path);
+            err = startupOnce(path, &cold, &trackCount, &container);
+        }
+        for (j = 0; j < iterations && err == OK; j++) {
+            err = startupOnce(path, &warm, &trackCount, &container);
+        }
+
+        printf("  {\"file\": ");
+        printJsonString(path);
+        if (err != OK) {
+            printf(", \"error\": %d}%s\n", err, i + 1 < files.size() ? "," : "");
+            continue;
+        }
+        printf(", \"container\": ");
+        printJsonString(container.string());
+        printf(", \"tracks\": %zu,\n   \"cold\": ", trackCount);
+        printStartupTimes(cold, trackCount);
+        printf(",\n   \"warm\": ");
+        printStartupTimes(warm, trackCount);
+        printf("}%s\n", i + 1 < files.size() ? "," : "");
+    }
+    printf("]\n}\n");
+}
+
+struct SniffStats {
+    int files;
+    int64_t wallUs;
+    int64_t cpuUs;
+    int64_t bytes;
+    int64_t reads;
+    int64_t allocs;
+    int64_t fileBytes;
+};
+
+static void printSniffStats(const SniffStats &stats)
+{
+    printf("\"wall_us\": %lld, \"cpu_us\": %lld, \"bytes_read\": %lld, "
+            "\"reads\": %lld, \"allocs\": %lld, \"file_bytes\": %lld",
+            (long long)stats.wallUs, (long long)stats.cpuUs,
+            (long long)stats.bytes, (long long)stats.reads,
+            (long long)stats.allocs, (long long)stats.fileBytes);
+}
+
+/*
+ * rejected: SniffFFMPEG returned false, both sniff paths were tried
+ * deferred: recognized, but with a confidence that leaves the file to
+ *           the stock extractor
+ * claimed:  FFmpegExtractor will be used
+ */
+static const char *sniffOutcome(bool sniffed, const sp<AMessage> &meta)
+{
+    AString use;
+
+    if (!sniffed) {
+        return "rejected";
+    }
+    if (meta != NULL && meta->findString("extended-extractor-use", &use)) {
+        return "claimed";
+    }
+    return "deferred";
+}
+
+static void runSniff(const SortedVector<String8> &files, int iterations)
+{
+    KeyedVector<String8, SniffStats> groups;
+    char value[PROPERTY_VALUE_MAX];
+    size_t i;
+    int j;
+
+    property_get("media.ffmpeg.sniff.header", value, "1");
+    printf("{\n\"benchmark\": \"sniff\",\n\"iterations\": %d,\n\"header_codecs\": %s,\n"
+            "\"files\": [\n", iterations, atoi(value) ? "true" : "false");
+    for (i = 0; i < files.size(); i++) {
+        const char *path = files[i].string();
+        sp<DataSource> file = new FileSource(path);
+        Vector<int64_t> wallUs, cpuUs;
+        SniffStats stats;
+        String8 container;
+        const char *outcome = "rejected";
+        float confidence = 0.0f;
+        AString url;
+        bool legacy = false;
+        off64_t size = 0;
+
+        memset(&stats, 0, sizeof(stats));
+        if (file->initCheck() != OK) {
+            continue;
+        }
+        file->getSize(&size);
+
+        for (j = 0; j < iterations; j++) {
+            sp<CountingDataSource> source = new CountingDataSource(file);
+            sp<AMessage> meta;
+            int64_t startUs, startCpuUs, startAllocs;
+            bool sniffed;
+
+            container.clear();
+            confidence = 0.0f;
+            startUs = wallTimeUs();
+            startCpuUs = cpuTimeUs(CLOCK_THREAD_CPUTIME_ID);
+            startAllocs = malloc_count();
+            sniffed = SniffFFMPEG(source, &container, &confidence, &meta);
+            wallUs.push(wallTimeUs() - startUs);
+            cpuUs.push(cpuTimeUs(CLOCK_THREAD_CPUTIME_ID) - startCpuUs);
+
+            /* the same on every run */
+            stats.allocs = malloc_count() - startAllocs;
+            stats.bytes = source->bytesRead();
+            stats.reads = source->reads();
+            outcome = sniffOutcome(sniffed, meta);
+            legacy = meta != NULL && meta->findString("extended-extractor-url", &url)
+                    && strstr(url.c_str(), "|file:") != NULL;
+        }
+        if (container.isEmpty()) {
+            container = "unknown";
+        }
+
+        wallUs.sort(compareTimes);
+        cpuUs.sort(compareTimes);
+        stats.files = 1;
+        stats.wallUs = wallUs[(wallUs.size() - 1) / 2];
+        stats.cpuUs = cpuUs[(cpuUs.size() - 1) / 2];
+        stats.fileBytes = size;
+
+        printf("  {\"file\": ");
+        printJsonString(path);
+        printf(", \"container\": ");
+        printJsonString(container.string());
+        printf(", \"outcome\": \"%s\", \"confidence\": %.2f, \"legacy_path\": %s, ",
+                outcome, confidence, legacy ? "true" : "false");
+        printSniffStats(stats);
+        printf(",\n   ");
+        printPercentiles("wall_us_dist", wallUs);
+        printf("}%s\n", i + 1 < files.size() ? "," : "");
+
+        String8 key(container);
+        key.appendFormat("/%s", outcome);
+        ssize_t index = groups.indexOfKey(key);
+        if (index < 0) {
+            SniffStats zero;
+            memset(&zero, 0, sizeof(zero));
+            index = groups.add(key, zero);
+        }
+        SniffStats &total = groups.editValueAt(index);
+        total.files++;
+        total.wallUs += stats.wallUs;
+        total.cpuUs += stats.cpuUs;
+        total.bytes += stats.bytes;
+        total.reads += stats.reads;
+        total.allocs += stats.allocs;
+        total.fileBytes += stats.fileBytes;
+    }
+    printf("],\n\"containers\": {\n");
+    for (i = 0; i < groups.size(); i++) {
+        printf("  ");
+        printJsonString(groups.keyAt(i).string());
+        printf(": {\"files\": %d, ", groups.valueAt(i).files);
+        printSniffStats(groups.valueAt(i));
+        printf("}%s\n", i + 1 < groups.size() ? "," : "");
+    }
+    printf("}\n}\n");
+}
+
+/* the generic path of find_start_code(), built here whatever the target */
+static const uint8_t *wordStartCode(const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *last = end - 3;
+
+    if (end - p < 3)
+        return end;
+
+    for (; p <= last && ((intptr_t)p & 3); p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    while (p + 4 <= end) {
+        uint32_t x = *(const uint32_t *)p;
+        if ((x - 0x01010101) & (~x) & 0x80808080) {
+            const uint8_t *q;
+            for (q = p; q < p + 4 && q <= last; q++) {
+                if (q[0] == 0 && q[1] == 0 && q[2] == 1)
+                    return q;
+            }
+        }
+        p += 4;
+    }
+    for (; p <= last; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    return end;
+}
+
+/* the loop the split helpers had before, every byte through a state */
+static const uint8_t *byteStartCode(const uint8_t *p, const uint8_t *end)
+{
+    uint32_t state = -1;
+
+    for (; p < end; p++) {
+        state = state << 8 | *p;
+        if ((state & 0xFFFFFF) == 0x000001)
+            return p - 2;
+    }
+    return end;
+}
+
+/* find_start_code() as the split helpers call it, the unit described */
+static const uint8_t *libStartCode(const uint8_t *p, const uint8_t *end)
+{
+    StartCode sc;
+
+    return find_start_code(p, end, &sc);
+}
+
+typedef const uint8_t *(*StartCodeScanner)(const uint8_t *p, const uint8_t *end);
+
+static const struct {
+    const char *name;
+    StartCodeScanner scan;
+} kStartCodeScanners[] = {
+    { "find_start_code", libStartCode },
+    { "word",            wordStartCode },
+    { "byte",            byteStartCode },
+};
+
+static int countStartCodes(StartCodeScanner scan, const uint8_t *buf, size_t size)
+{
+    const uint8_t *end = buf + size;
+    const uint8_t *p;
+    int count = 0;
+
+    for (p = scan(buf, end); p < end; p = scan(p + 3, end)) {
+        count++;
+    }
+    return count;
+}
+
+static void runStartCode(const SortedVector<String8> &files, int iterations)
+{
+    uint8_t *buf = (uint8_t *)malloc(STARTCODE_MAX_SIZE);
+    size_t i, k;
+    int j;
+
+    if (!buf) {
+        return;
+    }
+
+    printf("{\n\"benchmark\": \"startcode\",\n\"iterations\": %d,\n"
+            "\"find_start_code\": \"%s\",\n\"files\": [\n",
+            iterations, FIND_START_CODE_PATH);
+    for (i = 0; i < files.size(); i++) {
+        const char *path = files[i].string();
+        FILE *fp = fopen(path, "rb");
+        size_t size = 0;
+        int count = -1;
+        bool mismatch = false;
+
+        if (fp) {
+            size = fread(buf, 1, STARTCODE_MAX_SIZE, fp);
+            fclose(fp);
+        }
+
+        printf("  {\"file\": ");
+        printJsonString(path);
+        if (size == 0) {
+            printf(", \"error\": %d}%s\n", ERROR_IO, i + 1 < files.size() ? "," : "");
+            continue;
+        }
+        printf(", \"bytes\": %zu", size);
+
+        for (k = 0; k < FF_ARRAY_ELEMS(kStartCodeScanners); k++) {
+            Vector<int64_t> wallUs;
+            int64_t us;
+            int n = 0;
+
+            for (j = 0; j < iterations; j++) {
+                int64_t startUs = wallTimeUs();
+                n = countStartCodes(kStartCodeScanners[k].scan, buf, size);
+                wallUs.push(wallTimeUs() - startUs);
+            }
+            if (count < 0) {
+                count = n;
+            } else if (n != count) {
+                mismatch = true;
+            }
+
+            wallUs.sort(compareTimes);
+            us = wallUs[(wallUs.size() - 1) / 2];
+            printf(",\n   \"%s\": {\"wall_us\": %lld, \"mb_per_s\": %.1f}",
+                    kStartCodeScanners[k].name, (long long)us,
+                    us > 0 ? size / (us / 1E6) / (1024 * 1024) : 0.0);
+        }
+        printf(",\n   \"start_codes\": %d, \"mismatch\": %s}%s\n",
+                count, mismatch ? "true" : "false",
+                i + 1 < files.size() ? "," : "");
+    }
+    printf("]\n}\n");
+
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    SortedVector<String8> files;
+    const char *mode = "demux";
+    int iterations = DEFAULT_ITERATIONS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:p:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'p':
+            if (!setThreadPolicy(optarg)) {
+                iterations = 0;
+            }
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc || iterations <= 0
+            || (strcmp(mode, "demux") && strcmp(mode, "startup")
+                && strcmp(mode, "sniff") && strcmp(mode, "startcode"))) {
+        fprintf(stderr, "usage: %s [-m demux|startup|sniff|startcode] [-n iterations] "
+                "[-p role.prio|cpus|threads=value]... <file or directory>...\n", argv[0]);
+        return 1;
+    }
+    for (; optind < argc; optind++) {
+        collectFiles(argv[optind], &files);
+    }
+
+    if (!strcmp(mode, "startup")) {
+        runStartup(files, iterations);
+    } else if (!strcmp(mode, "sniff")) {
+        runSniff(files, iterations);
+    } else if (!strcmp(mode, "startcode")) {
+        runStartCode(files, iterations);
+    } else {
+        runDemux(files);
+    }
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2015 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The allocator entry points are defined here and exported from the
+ * executable, so calls from libavformat, libstagefright and friends land
+ * here first, are counted and handed on to libc through RTLD_NEXT.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "malloc_count.h"
+
+typedef void *(*malloc_fn)(size_t);
+typedef void *(*calloc_fn)(size_t, size_t);
+typedef void *(*realloc_fn)(void *, size_t);
+typedef void (*free_fn)(void *);
+typedef void *(*memalign_fn)(size_t, size_t);
+typedef int (*posix_memalign_fn)(void **, size_t, size_t);
+
+static malloc_fn real_malloc;
+static calloc_fn real_calloc;
+static realloc_fn real_realloc;
+static free_fn real_free;
+static memalign_fn real_memalign;
+static posix_memalign_fn real_posix_memalign;
+
+static int64_t s_count;
+static int s_resolving;
+
+/* dlsym may allocate while we are still resolving, serve it from here */
+static char s_arena[4096] __attribute__((aligned(16)));
+static size_t s_arena_used;
+
+static bool in_arena(void *p)
+{
+    return (char *)p >= s_arena && (char *)p < s_arena + sizeof(s_arena);
+}
+
+static void *arena_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (s_arena_used + size > sizeof(s_arena))
+        return NULL;
+    s_arena_used += size;
+    return s_arena + s_arena_used - size;
+}
+
+static void resolve(void)
+{
+    s_resolving = 1;
+    real_malloc = (malloc_fn)dlsym(RTLD_NEXT, "malloc");
+    real_calloc = (calloc_fn)dlsym(RTLD_NEXT, "calloc");
+    real_realloc = (realloc_fn)dlsym(RTLD_NEXT, "realloc");
+    real_free = (free_fn)dlsym(RTLD_NEXT, "free");
+    real_memalign = (memalign_fn)dlsym(RTLD_NEXT, "memalign");
+    real_posix_memalign = (posix_memalign_fn)dlsym(RTLD_NEXT, "posix_memalign");
+    s_resolving = 0;
+}
+
+int64_t malloc_count(void)
+{
+    return __sync_fetch_and_add(&s_count, 0);
+}
+
+extern "C" {
+
+void *malloc(size_t size)
+{
+    if (!real_malloc) {
+        if (s_resolving)
+            return arena_alloc(size);
+        resolve();
+    }
+    __sync_fetch_and_add(&s_count, 1);
+    return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (!real_calloc) {
+        if (s_resolving)
+            return arena_alloc(nmemb * size); /* static, already zeroed */
+        resolve();
+    }
+    __sync_fetch_and_add(&s_count, 1);
+    return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!real_realloc)
+        resolve();
+    __sync_fetch_and_add(&s_count, 1);
+    if (in_arena(ptr)) {
+        void *p = real_malloc(size);
+        size_t left = s_arena + sizeof(s_arena) - (char *)ptr;
+        if (p)
+            memcpy(p, ptr, size < left ? size : left);
+        return p;
+    }
+    return real_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (!ptr || in_arena(ptr))
+        return;
+    if (!real_free)
+        resolve();
+    real_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    if (!real_memalign)
+        resolve();
+    __sync_fetch_and_add(&s_count, 1);
+    return real_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (!real_posix_memalign)
+        resolve();
+    __sync_fetch_and_add(&s_count, 1);
+    return real_posix_memalign(memptr, alignment, size);
+}
+
+}  // extern "C"
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2015 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MALLOC_COUNT_H_
+#define MALLOC_COUNT_H_
+
+#include <stdint.h>
+
+// Number of heap allocations made by the whole process so far, through
+// malloc, calloc, realloc, memalign or posix_memalign.
+int64_t malloc_count(void);
+
+#endif  // MALLOC_COUNT_H_
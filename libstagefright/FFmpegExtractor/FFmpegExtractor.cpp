@@ -22,7 +22,6 @@
 #include <stdint.h>
 #include <limits.h> /* INT_MAX */
 #include <inttypes.h>
-#include <sys/prctl.h>
 
 #include <utils/misc.h>
 #include <utils/String8.h>
@@ -52,6 +51,18 @@
 #define MIN_FRAMES 5
 #define EXTRACTOR_MAX_PROBE_PACKETS 200
 #define FF_MAX_EXTRADATA_SIZE ((1 << 28) - FF_INPUT_BUFFER_PADDING_SIZE)
+#define KEYFRAME_READ_THROUGH_SIZE (512 * 1024)
+#define OPEN_TIMEOUT_US  (20 * 1000000LL)
+#define READ_TIMEOUT_US  (10 * 1000000LL)
+#define PROBE_TIMEOUT_US (5 * 1000000LL)
+#define LIVE_PROBE_SIZE           (32 * 1024)
+#define LIVE_ANALYZE_DURATION_US  500000
+#define LIVE_MAX_DELAY_US         100000
+#define LIVE_MAX_QUEUED_US        200000
+#define DURATION_WINDOW_SIZE      (256 * 1024)
+#define PRESNIFF_SIZE             4096
+#define BUFFER_POOL_MIN_SHIFT 12 /* 4KB */
+#define BUFFER_POOL_CLASSES   14 /* up to 32MB */
 
 #define WAIT_KEY_PACKET_AFTER_SEEK 1
 #define SUPPOURT_UNKNOWN_FORMAT    1
@@ -70,6 +81,64 @@ enum {
 
 namespace android {
 
+/* Recycles the MediaBuffers of a source in power of two size classes.
+ * A request is served from its own class or any larger free buffer, so
+ * once the pool has grown to the largest packet size it stops allocating.
+ * A client may still hold buffers when the source goes, so the pool is
+ * released rather than deleted and lives on until the last one is back.
+ */
+struct FFmpegBufferPool : public MediaBufferObserver {
+    FFmpegBufferPool() : mReleased(false) {}
+
+    // NULL if size is out of the range of the pool
+    MediaBuffer *acquire(size_t size);
+
+    // free the pool, at once or when the last buffer out comes back
+    void release();
+
+    virtual void signalBufferReturned(MediaBuffer *buffer);
+
+private:
+    Mutex mLock;
+    bool mReleased;
+    Vector<MediaBuffer *> mBuffers;
+    Vector<MediaBuffer *> mFreeBuffers[BUFFER_POOL_CLASSES];
+
+    virtual ~FFmpegBufferPool();
+    static int sizeClass(size_t size);
+    void freeBuffer(MediaBuffer *buffer);
+
+    DISALLOW_EVIL_CONSTRUCTORS(FFmpegBufferPool);
+};
+
+/* A MediaBuffer over the payload of a refcounted packet, which holds a
+ * reference to the packet buffer until the consumer releases it.
+ */
+struct FFmpegPacketBuffer : public MediaBuffer {
+    static MediaBuffer *create(const AVPacket *pkt) {
+        AVBufferRef *ref = av_buffer_ref(pkt->buf);
+        if (ref == NULL) {
+            return NULL;
+        }
+        return new FFmpegPacketBuffer(pkt->data, pkt->size, ref);
+    }
+
+protected:
+    virtual ~FFmpegPacketBuffer() {
+        av_buffer_unref(&mBufferRef);
+    }
+
+private:
+    AVBufferRef *mBufferRef;
+
+    FFmpegPacketBuffer(uint8_t *data, size_t size, AVBufferRef *ref)
+        : MediaBuffer(data, size),
+          mBufferRef(ref) {
+    }
+
+    DISALLOW_EVIL_CONSTRUCTORS(FFmpegPacketBuffer);
+};
+
 struct FFmpegSource : public MediaSource {
     FFmpegSource(const sp<FFmpegExtractor> &extractor, size_t index);
 
@@ -94,6 +163,7 @@ private:
     mutable Mutex mLock;
 
     bool mIsAVC;
+    bool mIsHEVC;
     size_t mNALLengthSize;
     bool mNal2AnnexB;
 
@@ -101,6 +171,23 @@ private:
     PacketQueue *mQueue;
 
     int64_t mFirstKeyPktTimestamp;
+    int mQueueSerial;
+    bool mWaitKeyPkt;
+
+    FFmpegBufferPool *mBufferPool;
+
+    AVPacket mPendingPkt;
+    int mPendingSerial;
+    bool mHasPendingPkt;
+
+    status_t readBatch(
+            MediaBuffer **buffer, Vector<FFmpegExtractor::AccessUnitInfo> *units,
+            size_t maxUnits, int64_t maxDurationUs, size_t maxBytes,
+            const ReadOptions *options);
+    status_t readPacket(AVPacket *pkt, const ReadOptions *options);
+    int64_t packetTimeUs(const AVPacket *pkt);
+    status_t writePacketData(const AVPacket *pkt, uint8_t *dst);
+    status_t packetToMediaBuffer(AVPacket *pkt, MediaBuffer **buffer);
 
     DISALLOW_EVIL_CONSTRUCTORS(FFmpegSource);
 };
@@ -113,6 +200,7 @@ FFmpegExtractor::FFmpegExtractor(const sp<DataSource> &source, const sp<AMessage
       mInitCheck(NO_INIT),
       mFFmpegInited(false),
       mFormatCtx(NULL),
+      mLiveMode(false),
       mReaderThreadStarted(false) {
     ALOGV("FFmpegExtractor::FFmpegExtractor");
 
@@ -124,28 +212,42 @@ FFmpegExtractor::FFmpegExtractor(const sp<DataSource> &source, const sp<AMessage
         return;
     }
 
-    // start reader here, as we want to extract extradata from bitstream if no extradata
-    startReaderThread();
-
-    while(mProbePkts <= EXTRACTOR_MAX_PROBE_PACKETS && !mEOF &&
-        (mFormatCtx->pb ? !mFormatCtx->pb->error : 1) &&
-        (mDefersToCreateVideoTrack || mDefersToCreateAudioTrack)) {
-        ALOGV("mProbePkts=%d", mProbePkts);
-        usleep(5000);
+    if (mDefersToCreateVideoTrack || mDefersToCreateAudioTrack) {
+        // extract extradata from bitstream if no extradata
+        if (probe_deferred_tracks() < 0) {
+            ALOGE("failed to probe the deferred tracks");
+            return;
+        }
     }
 
-    ALOGV("mProbePkts: %d, mEOF: %d, pb->error(if has): %d, mDefersToCreateVideoTrack: %d, mDefersToCreateAudioTrack: %d",
-        mProbePkts, mEOF, mFormatCtx->pb ? mFormatCtx->pb->error : 0, mDefersToCreateVideoTrack, mDefersToCreateAudioTrack);
+    // the reader is started by the first FFmpegSource::start or read, so
+    // opens that only need metadata never spin it up
+    if (mTracks.size() == 1) {
+        // a single consumer reads the demuxer on its own thread
+        ALOGV("pull mode on stream %d", mTracks.itemAt(0).mIndex);
+        mPullMode = true;
+        mPullStreamIdx = mTracks.itemAt(0).mIndex;
+        for (int i = 0; i < (int)mFormatCtx->nb_streams; i++) {
+            if (i != mPullStreamIdx)
+                mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
 
     mInitCheck = OK;
 }
 
 FFmpegExtractor::~FFmpegExtractor() {
     ALOGV("FFmpegExtractor::~FFmpegExtractor");
-    Mutex::Autolock autoLock(mLock);
-    // stop reader here if no track!
+    // stop reader here if no track! mLock is not held, the reader needs it
+    // to see the abort request
     stopReaderThread();
 
+    // the reader thread may never have been started
+    if (mAudioStreamIdx >= 0)
+        stream_component_close(mAudioStreamIdx);
+    if (mVideoStreamIdx >= 0)
+        stream_component_close(mVideoStreamIdx);
+
     deInitStreams();
 }
 
@@ -167,7 +269,7 @@ sp<MediaSource> FFmpegExtractor::getTrack(size_t index) {
     return new FFmpegSource(this, index);
 }
 
-sp<MetaData> FFmpegExtractor::getTrackMetaData(size_t index, uint32_t flags __unused) {
+sp<MetaData> FFmpegExtractor::getTrackMetaData(size_t index, uint32_t flags) {
     ALOGV("FFmpegExtractor::getTrackMetaData[%d]", index);
 
     if (mInitCheck != OK) {
@@ -178,6 +280,25 @@ sp<MetaData> FFmpegExtractor::getTrackMetaData(size_t index, uint32_t flags __un
         return NULL;
     }
 
+    // The metadata retriever asks for the extensive metadata of the track it
+    // is going to take a frame from. If nothing has been read yet, serve that
+    // track straight from the demuxer instead of starting the reader thread.
+    if (flags & kIncludeExtensiveMetaData) {
+        Mutex::Autolock autoLock(mLock);
+        const TrackInfo &info = mTracks.itemAt(index);
+        if (!mReaderThreadStarted
+                && info.mStream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            ALOGV("thumbnail mode on stream %d", info.mIndex);
+            mThumbnailMode = true;
+            mPullMode = true;
+            mPullStreamIdx = info.mIndex;
+            for (int i = 0; i < (int)mFormatCtx->nb_streams; i++) {
+                if (i != mPullStreamIdx)
+                    mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+    }
+
     /* Quick and dirty, just get a frame 1/4 in */
     if (mFormatCtx->duration != AV_NOPTS_VALUE) {
         mTracks.itemAt(index).mMeta->setInt64(
@@ -233,9 +354,11 @@ int FFmpegExtractor::check_extradata(AVCodecContext *avctx)
 
     // ignore extradata
     if (codec_id != AV_CODEC_ID_H264
+            && codec_id != AV_CODEC_ID_HEVC
             && codec_id != AV_CODEC_ID_MPEG4
             && codec_id != AV_CODEC_ID_MPEG1VIDEO
             && codec_id != AV_CODEC_ID_MPEG2VIDEO
+            && codec_id != AV_CODEC_ID_VC1
             && codec_id != AV_CODEC_ID_AAC) {
         return 1;
     }
@@ -260,21 +383,18 @@ int FFmpegExtractor::check_extradata(AVCodecContext *avctx)
     if (avctx->extradata_size <= 0) {
         ALOGI("No %s extradata found, should to extract it from bitstream",
                 av_get_media_type_string(avctx->codec_type));
-        *defersToCreateTrack = true;
          //CHECK(name != NULL);
         if (!*bsfc && name) {
             *bsfc = av_bitstream_filter_init(name);
             if (!*bsfc) {
                 ALOGE("Cannot open the %s BSF!", name);
-                *defersToCreateTrack = false;
                 return -1;
-            } else {
-                ALOGV("open the %s bsf", name);
-                return 0;
             }
-        } else {
-            return 0;
+            ALOGV("open the %s bsf", name);
         }
+
+        *defersToCreateTrack = true;
+        return 0;
     }
     return 1;
 }
@@ -714,6 +834,7 @@ void FFmpegExtractor::stream_component_close(int stream_index)
             av_bitstream_filter_close(mAudioBsfc);
             mAudioBsfc  = NULL;
         }
+        mAudioStripADTS = false;
         break;
     case AVMEDIA_TYPE_SUBTITLE:
         break;
@@ -734,196 +855,932 @@ void FFmpegExtractor::reachedEOS(enum AVMediaType media_type)
     mCondition.signal();
 }
 
-/* seek in the stream */
+/* seek in the stream
+ *
+ * Audio and video share one seek transaction: the seek is always done on the
+ * video stream if there is one, both queues are flushed once by the reader
+ * thread and every waiting source is released together. A source that asks
+ * for the same seek while the other one's transaction is still unread in
+ * its own queue joins that transaction instead of starting a new one. A
+ * seek to anywhere else starts a new transaction, or retargets the one the
+ * reader has not done yet.
+ *
+ * pos is relative to the start of the stream, *serial is the queue serial
+ * last read by the caller on input and the serial to wait for on output.
+ */
 int FFmpegExtractor::stream_seek(int64_t pos, enum AVMediaType media_type,
-        MediaSource::ReadOptions::SeekMode mode)
+        MediaSource::ReadOptions::SeekMode mode, int *serial)
 {
     Mutex::Autolock _l(mLock);
 
-    if (mSeekIdx >= 0 || (mVideoStreamIdx >= 0
-            && mAudioStreamIdx >= 0
-            && media_type == AVMEDIA_TYPE_AUDIO
-            && !mVideoEOSReceived)) {
-       return NO_SEEK;
+    PacketQueue *q = media_type == AVMEDIA_TYPE_VIDEO ? &mVideoQ : &mAudioQ;
+    int lastSerial = q->serial;
+
+    bool sameTarget = pos == mSeekTimeUs && mode == mSeekMode;
+
+    if (mSeekIdx < 0 && *serial < lastSerial && sameTarget) {
+        ALOGV("%s joins the pending seek(serial: %d)",
+                av_get_media_type_string(media_type), lastSerial);
+        *serial = lastSerial;
+        return SEEK;
     }
 
-    // flush immediately
-    if (mAudioStreamIdx >= 0)
-        packet_queue_flush(&mAudioQ);
-    if (mVideoStreamIdx >= 0)
-        packet_queue_flush(&mVideoQ);
+    // the reader holds mLock while seeking, so a pending seek is not started
+    if (mSeekIdx < 0 || !sameTarget) {
+        mSeekIdx = (mVideoStreamIdx >= 0 && !mVideoStopped) ? mVideoStreamIdx : mAudioStreamIdx;
+        if (mSeekIdx < 0) {
+            return NO_SEEK;
+        }
+        mSeekTimeUs = pos;
+        mSeekMode = mode;
+
+        AVStream *st = mFormatCtx->streams[mSeekIdx];
+        mSeekPos = av_rescale_q(pos, AV_TIME_BASE_Q, st->time_base);
+        if (st->start_time != AV_NOPTS_VALUE)
+            mSeekPos += st->start_time;
+
+        mSeekFlags = AVSEEK_FLAG_BACKWARD;
+        if (mSeekByBytes) {
+            int64_t bytePos = seek_byte_pos(st, mSeekPos, pos);
+            if (bytePos >= 0) {
+                ALOGV("seek by bytes to %lld for %lld us", bytePos, pos);
+                mSeekPos = bytePos;
+                mSeekFlags = AVSEEK_FLAG_BYTE;
+            }
+        }
+
+        switch (mode) {
+            case MediaSource::ReadOptions::SEEK_PREVIOUS_SYNC:
+                mSeekMin = INT64_MIN;
+                mSeekMax = mSeekPos;
+                break;
+            case MediaSource::ReadOptions::SEEK_CLOSEST_SYNC:
+                mSeekMin = INT64_MIN;
+                mSeekMax = INT64_MAX;
+                break;
+            case MediaSource::ReadOptions::SEEK_NEXT_SYNC:
+                mSeekMin = mSeekPos;
+                mSeekMax = INT64_MAX;
+                break;
+            default:
+                TRESPASS();
+        }
 
-    mSeekIdx = media_type == AVMEDIA_TYPE_VIDEO ? mVideoStreamIdx : mAudioStreamIdx;
-    mSeekPos = av_rescale_q(pos, AV_TIME_BASE_Q, mFormatCtx->streams[mSeekIdx]->time_base);
+        // wake up the reader if it is waiting for the queues to drain
+        mCondition.signal();
+    }
 
-    //mSeekFlags &= ~AVSEEK_FLAG_BYTE;
-    //if (mSeekByBytes) {
-    //    mSeekFlags |= AVSEEK_FLAG_BYTE;
-    //}
+    while (mSeekIdx >= 0 && !mAbortRequest) {
+        mSeekCondition.wait(mLock);
+    }
 
-    switch (mode) {
-        case MediaSource::ReadOptions::SEEK_PREVIOUS_SYNC:
-            mSeekMin = INT64_MIN;
-            mSeekMax = mSeekPos;
-            break;
-        case MediaSource::ReadOptions::SEEK_CLOSEST_SYNC:
-            mSeekMin = INT64_MIN;
-            mSeekMax = INT64_MAX;
-            break;
-        case MediaSource::ReadOptions::SEEK_NEXT_SYNC:
-            mSeekMin = mSeekPos;
-            mSeekMax = INT64_MAX;
-            break;
-        default:
-            TRESPASS();
+    if (q->serial == lastSerial) {
+        // the seek failed or was aborted, the queue was not touched
+        return NO_SEEK;
     }
 
-    mCondition.wait(mLock);
+    *serial = q->serial;
     return SEEK;
 }
 
-// staitc
-int FFmpegExtractor::decode_interrupt_cb(void *ctx)
+/* estimate the file offset for a byte seek to ts (timeUs from the start):
+ * from the keyframe index if the demuxer built one, else from the bitrate
+ * or the file size over the duration. Return -1 if nothing tells.
+ */
+int64_t FFmpegExtractor::seek_byte_pos(AVStream *st, int64_t ts, int64_t timeUs)
 {
-    FFmpegExtractor *extractor = static_cast<FFmpegExtractor *>(ctx);
-    return extractor->mAbortRequest;
+    int64_t size = mFormatCtx->pb ? avio_size(mFormatCtx->pb) : -1;
+    int64_t bytePos = -1;
+    int idx = av_index_search_timestamp(st, ts, AVSEEK_FLAG_BACKWARD);
+
+    if (idx >= 0 && st->index_entries[idx].pos >= 0) {
+        return st->index_entries[idx].pos;
+    }
+
+    if (timeUs <= 0) {
+        bytePos = 0;
+    } else if (mFormatCtx->bit_rate > 0) {
+        bytePos = av_rescale(timeUs, mFormatCtx->bit_rate, 8 * AV_TIME_BASE);
+    } else if (size > 0 && mDuration > 0) {
+        bytePos = av_rescale(timeUs, size, mDuration);
+    }
+
+    if (size > 0 && bytePos >= size) {
+        bytePos = size - 1;
+    }
+    return bytePos;
 }
 
-void FFmpegExtractor::fetchStuffsFromSniffedMeta(const sp<AMessage> &meta)
+/* read size bytes at pos through the demuxer's own I/O, so that the
+ * interrupt callback can stop it like any other read */
+static int read_window(AVIOContext *pb, int64_t pos, uint8_t *buf, int size)
 {
-    AString url;
-    AString mime;
+    if (avio_seek(pb, pos, SEEK_SET) < 0) {
+        return -1;
+    }
+    return avio_read(pb, buf, size);
+}
 
-    //url
-    CHECK(meta->findString("extended-extractor-url", &url));
-    CHECK(url.c_str() != NULL);
-    CHECK(url.size() < PATH_MAX);
+/* replace a missing or bitrate-guessed duration by one read from the
+ * first and last DURATION_WINDOW_SIZE bytes of the file: the PCR span for
+ * mpegts, the last granule position for ogg and the average frame size
+ * for mp3. Nothing else of the file is read. The demuxer's position is
+ * put back afterwards.
+ */
+void FFmpegExtractor::estimate_duration()
+{
+    const char *name = mFormatCtx->iformat->name;
+    AVIOContext *pb = mFormatCtx->pb;
+    AVStream *st = NULL;
+    uint8_t *head = NULL, *tail = NULL;
+    int64_t size = 0, pos = 0;
+    int headSize, tailSize;
+    int64_t duration = -1;
+    int i;
+
+    if (mFormatCtx->duration != AV_NOPTS_VALUE
+            && mFormatCtx->duration_estimation_method != AVFMT_DURATION_FROM_BITRATE) {
+        return;
+    }
+    if (strcmp(name, "mpegts") && strcmp(name, "ogg") && strcmp(name, "mp3")) {
+        return;
+    }
+    if (!pb || !pb->seekable || (size = avio_size(pb)) <= 0) {
+        return;
+    }
+    pos = avio_tell(pb);
 
-    memcpy(mFilename, url.c_str(), url.size());
-    mFilename[url.size()] = '\0';
+    for (i = 0; i < (int)mFormatCtx->nb_streams; i++) {
+        if (mFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+            st = mFormatCtx->streams[i];
+            break;
+        }
+    }
 
-    //mime
-    CHECK(meta->findString("extended-extractor-mime", &mime));
-    CHECK(mime.c_str() != NULL);
-    mMeta->setCString(kKeyMIMEType, mime.c_str());
+    head = (uint8_t *)av_malloc(DURATION_WINDOW_SIZE);
+    tail = (uint8_t *)av_malloc(DURATION_WINDOW_SIZE);
+    if (!head || !tail) {
+        goto out;
+    }
+    headSize = read_window(pb, 0, head, DURATION_WINDOW_SIZE);
+    tailSize = read_window(pb,
+            FFMAX(size - DURATION_WINDOW_SIZE, 0), tail, DURATION_WINDOW_SIZE);
+    if (headSize <= 0 || tailSize <= 0) {
+        goto out;
+    }
+
+    if (!strcmp(name, "mpegts")) {
+        duration = ts_duration_from_pcr(head, headSize, tail, tailSize);
+    } else if (!strcmp(name, "ogg")) {
+        const char *magic = NULL;
+        int magic_size = 0, rate = 0;
+        int64_t granule;
+
+        if (!st) {
+            goto out;
+        }
+        switch (st->codec->codec_id) {
+        case AV_CODEC_ID_VORBIS:
+            magic = "\x01vorbis";
+            magic_size = 7;
+            rate = st->codec->sample_rate;
+            break;
+        case AV_CODEC_ID_OPUS:
+            magic = "OpusHead";
+            magic_size = 8;
+            rate = 48000;
+            break;
+        case AV_CODEC_ID_FLAC:
+            magic = "\x7f" "FLAC";
+            magic_size = 5;
+            rate = st->codec->sample_rate;
+            break;
+        default:
+            goto out;
+        }
+        granule = ogg_last_granule(head, headSize, tail, tailSize,
+                magic, magic_size);
+        if (st->codec->codec_id == AV_CODEC_ID_OPUS
+                && st->codec->extradata_size >= 12) {
+            granule -= AV_RL16(st->codec->extradata + 10); // pre-skip
+        }
+        if (granule > 0 && rate > 0) {
+            duration = av_rescale(granule, AV_TIME_BASE, rate);
+        }
+    } else {
+        int64_t start = 0, end = size, bytes = 0, tailBytes = 0;
+        int frames, tailFrames, spf, sr, tailSpf, tailSr;
+
+        /* ID3v2 header at the start, ID3v1 tag at the end */
+        if (headSize >= 10 && !memcmp(head, "ID3", 3)) {
+            start = 10 + ((head[6] & 0x7f) << 21 | (head[7] & 0x7f) << 14
+                    | (head[8] & 0x7f) << 7 | (head[9] & 0x7f));
+            if (head[5] & 0x10) {
+                start += 10; // footer
+            }
+            // the tag may be larger than the window, read past it
+            headSize = read_window(pb, start, head, DURATION_WINDOW_SIZE);
+            if (headSize <= 0) {
+                goto out;
+            }
+            if (size - DURATION_WINDOW_SIZE < start) {
+                tailSize = read_window(pb, start, tail, DURATION_WINDOW_SIZE);
+                if (tailSize <= 0) {
+                    goto out;
+                }
+            }
+        }
+        if (tailSize >= 128 && !memcmp(tail + tailSize - 128, "TAG", 3)) {
+            end -= 128;
+            tailSize -= 128;
+        }
+        if (end <= start) {
+            goto out;
+        }
+
+        frames = mp3_frame_stats(head, headSize, &bytes, &spf, &sr);
+        tailFrames = mp3_frame_stats(tail, tailSize,
+                &tailBytes, &tailSpf, &tailSr);
+        if (frames <= 0) {
+            goto out;
+        }
+        if (tailFrames > 0 && tailSpf == spf && tailSr == sr) {
+            frames += tailFrames;
+            bytes += tailBytes;
+        }
+        /* duration = (end - start) / (bytes / frames) * spf / sr */
+        duration = av_rescale((end - start) * spf, (int64_t)frames * AV_TIME_BASE,
+                bytes * sr);
+    }
+
+    if (duration <= 0) {
+        goto out;
+    }
+    ALOGV("%s: estimated duration %lld us (was %lld)",
+            name, duration, mFormatCtx->duration);
+    mFormatCtx->duration = duration;
+    for (i = 0; i < (int)mFormatCtx->nb_streams; i++) {
+        AVStream *s = mFormatCtx->streams[i];
+        s->duration = av_rescale_q(duration, AV_TIME_BASE_Q, s->time_base);
+    }
+
+out:
+    avio_seek(pb, pos, SEEK_SET);
+    av_free(head);
+    av_free(tail);
 }
 
-void FFmpegExtractor::setFFmpegDefaultOpts()
+size_t FFmpegExtractor::peakQueuedBytes() const
 {
-    mGenPTS       = 0;
-#if DEBUG_DISABLE_VIDEO
-    mVideoDisable = 1;
-#else
-    mVideoDisable = 0;
-#endif
-#if DEBUG_DISABLE_AUDIO
-    mAudioDisable = 1;
-#else
-    mAudioDisable = 0;
-#endif
-    mShowStatus   = 0;
-    mSeekByBytes  = 0; /* seek by bytes 0=off 1=on -1=auto" */
-    mDuration     = AV_NOPTS_VALUE;
-    mSeekPos      = AV_NOPTS_VALUE;
-    mSeekMin      = INT64_MIN;
-    mSeekMax      = INT64_MAX;
-    mLoop         = 1;
-
-    mVideoStreamIdx = -1;
-    mAudioStreamIdx = -1;
-    mVideoStream  = NULL;
-    mAudioStream  = NULL;
-    mDefersToCreateVideoTrack = false;
-    mDefersToCreateAudioTrack = false;
-    mVideoBsfc = NULL;
-    mAudioBsfc = NULL;
+    return mPeakQueuedSize;
+}
 
-    mAbortRequest = 0;
-    mPaused       = 0;
-    mLastPaused   = 0;
-    mProbePkts    = 0;
-    mEOF          = false;
+bool FFmpegExtractor::isPullStream(int stream_index)
+{
+    Mutex::Autolock _l(mLock);
 
-    mSeekIdx      = -1;
-    mSeekMode     = MediaSource::ReadOptions::SEEK_CLOSEST_SYNC;
+    return mPullMode && stream_index == mPullStreamIdx;
 }
 
-int FFmpegExtractor::initStreams()
+/* A stopped track is neither demuxed nor queued until its source is started
+ * again. Tracks whose source was never started are still demuxed, so the
+ * second source to start does not miss the beginning of the stream.
+ * Return true if the state changed.
+ */
+bool FFmpegExtractor::setStreamStopped(int stream_index, bool stopped)
 {
-    int err = 0;
-    int i = 0;
-    status_t status = UNKNOWN_ERROR;
-    int eof = 0;
-    int ret = 0, audio_ret = -1, video_ret = -1;
-    int pkt_in_play_range = 0;
-    AVDictionaryEntry *t = NULL;
-    AVDictionary **opts = NULL;
-    int orig_nb_streams = 0;
-    int st_index[AVMEDIA_TYPE_NB] = {0};
-    int wanted_stream[AVMEDIA_TYPE_NB] = {0};
-    st_index[AVMEDIA_TYPE_AUDIO]  = -1;
-    st_index[AVMEDIA_TYPE_VIDEO]  = -1;
-    wanted_stream[AVMEDIA_TYPE_AUDIO]  = -1;
-    wanted_stream[AVMEDIA_TYPE_VIDEO]  = -1;
-    const char *mime = NULL;
+    Mutex::Autolock _l(mLock);
 
-    setFFmpegDefaultOpts();
+    PacketQueue *q = NULL;
+    bool *state = NULL;
 
-    status = initFFmpeg();
-    if (status != OK) {
-        ret = -1;
-        goto fail;
+    if (mPullMode) {
+        return false;
     }
-    mFFmpegInited = true;
 
-    mFormatCtx = avformat_alloc_context();
-    if (!mFormatCtx)
-    {
-        ALOGE("oom for alloc avformat context");
-        ret = -1;
-        goto fail;
+    if (stream_index == mVideoStreamIdx) {
+        q = &mVideoQ;
+        state = &mVideoStopped;
+    } else if (stream_index == mAudioStreamIdx) {
+        q = &mAudioQ;
+        state = &mAudioStopped;
+    } else {
+        return false;
     }
-    mFormatCtx->interrupt_callback.callback = decode_interrupt_cb;
-    mFormatCtx->interrupt_callback.opaque = this;
-    ALOGV("mFilename: %s", mFilename);
-    err = avformat_open_input(&mFormatCtx, mFilename, NULL, &format_opts);
-    if (err < 0) {
-        ALOGE("%s: avformat_open_input failed, err:%s", mFilename, av_err2str(err));
-        ret = -1;
-        goto fail;
+
+    if (*state == stopped) {
+        return false;
     }
 
-    if ((t = av_dict_get(format_opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
-        ALOGE("Option %s not found.\n", t->key);
-        //ret = AVERROR_OPTION_NOT_FOUND;
-        ret = -1;
-        goto fail;
+    ALOGV("%s stream %d", stopped ? "stop" : "restart", stream_index);
+    *state = stopped;
+    mFormatCtx->streams[stream_index]->discard =
+            stopped ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    if (stopped) {
+        packet_queue_flush(q);
     }
+    // the reader may be waiting for the queue of the stopped track
+    mCondition.signal();
 
-    if (mGenPTS)
-        mFormatCtx->flags |= AVFMT_FLAG_GENPTS;
+    return true;
+}
 
-    opts = setup_find_stream_info_opts(mFormatCtx, codec_opts);
-    orig_nb_streams = mFormatCtx->nb_streams;
+/* run the audio bitstream filter over pkt in place.
+ * Return false if the packet should be dropped.
+ */
+bool FFmpegExtractor::filter_audio_packet(AVPacket *pkt)
+{
+    int ret;
+    uint8_t *outbuf;
+    int   outbuf_size;
+    AVCodecContext *avctx = mFormatCtx->streams[mAudioStreamIdx]->codec;
+
+    if (mAudioStripADTS && pkt->data) {
+        int skip = adts_header_size(pkt->data, pkt->size);
+        if (skip > 0 && pkt->buf) {
+            pkt->data += skip;
+            pkt->size -= skip;
+        } else if (skip > 0) {
+            memmove(pkt->data, pkt->data + skip, pkt->size - skip);
+            pkt->size -= skip;
+        }
+        return pkt->size > 0;
+    }
 
-    err = avformat_find_stream_info(mFormatCtx, opts);
-    if (err < 0) {
-        ALOGE("%s: could not find stream info, err:%s", mFilename, av_err2str(err));
-        ret = -1;
-        goto fail;
+    if (!mAudioBsfc || !pkt->data) {
+        return true;
     }
-    for (i = 0; i < orig_nb_streams; i++)
-        av_dict_free(&opts[i]);
-    av_freep(&opts);
 
-    if (mFormatCtx->pb)
-        mFormatCtx->pb->eof_reached = 0; // FIXME hack, ffplay maybe should not use url_feof() to test for the end
+    ret = av_bitstream_filter_filter(mAudioBsfc, avctx, NULL, &outbuf, &outbuf_size,
+                       pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
 
-    if (mSeekByBytes < 0)
-        mSeekByBytes = !!(mFormatCtx->iformat->flags & AVFMT_TS_DISCONT)
-            && strcmp("ogg", mFormatCtx->iformat->name);
+    if (ret < 0 ||!outbuf_size) {
+        return false;
+    }
+    if (outbuf && outbuf != pkt->data) {
+        if (ret == 0 && pkt->buf
+                && outbuf > pkt->data && outbuf + outbuf_size <= pkt->data + pkt->size) {
+            // the headers were stripped, skip them without copying
+            pkt->data = outbuf;
+            pkt->size = outbuf_size;
+        } else {
+            memmove(pkt->data, outbuf, outbuf_size);
+            pkt->size = outbuf_size;
+            if (ret > 0) {
+                av_free(outbuf);
+            }
+        }
+    }
+    return true;
+}
 
-    for (i = 0; i < (int)mFormatCtx->nb_streams; i++)
+/* read the pull stream synchronously, without the reader thread and the
+ * packet queues. This serves the thumbnail mode and files with a single
+ * track. Return 0 if the stream is not pulled, 1 if a packet was read,
+ * < 0 on error or end of stream.
+ */
+int FFmpegExtractor::pull_read(int stream_index, int64_t seekTimeUs,
+        MediaSource::ReadOptions::SeekMode mode, AVPacket *pkt)
+{
+    Mutex::Autolock _l(mLock);
+
+    if (!mPullMode || stream_index != mPullStreamIdx) {
+        return 0;
+    }
+
+    AVStream *st = mFormatCtx->streams[stream_index];
+    PacketQueue *q = stream_index == mVideoStreamIdx ? &mVideoQ : &mAudioQ;
+    bool waitKey = false;
+    int ret = 0;
+
+    if (seekTimeUs == AV_NOPTS_VALUE) {
+        // the packets queued while probing come first
+        while (packet_queue_get(q, pkt, 0, NULL) > 0) {
+            if (pkt->data == q->flush_pkt.data || !pkt->data) {
+                av_free_packet(pkt);
+                continue;
+            }
+            return 1;
+        }
+    } else {
+        packet_queue_flush(q);
+    }
+
+    if (mThumbnailMode) {
+        setIODeadline(READ_TIMEOUT_US);
+    }
+
+    if (seekTimeUs != AV_NOPTS_VALUE) {
+        int64_t ts = av_rescale_q(seekTimeUs, AV_TIME_BASE_Q, st->time_base);
+        int64_t min = INT64_MIN;
+        int64_t max = INT64_MAX;
+        int seekIdx = stream_index;
+        int flags = mThumbnailMode ? 0 : AVSEEK_FLAG_BACKWARD;
+
+        if (st->start_time != AV_NOPTS_VALUE)
+            ts += st->start_time;
+
+        if (mSeekByBytes) {
+            int64_t bytePos = seek_byte_pos(st, ts, seekTimeUs);
+            if (bytePos >= 0) {
+                ALOGV("pull seek by bytes to %lld for %lld us", bytePos, seekTimeUs);
+                ts = bytePos;
+                seekIdx = -1;
+                flags = AVSEEK_FLAG_BYTE;
+            }
+        }
+
+        switch (mode) {
+            case MediaSource::ReadOptions::SEEK_PREVIOUS_SYNC:
+                max = ts;
+                break;
+            case MediaSource::ReadOptions::SEEK_NEXT_SYNC:
+                min = ts;
+                break;
+            default:
+                // the keyframe nearest to ts
+                break;
+        }
+
+        ALOGV("pull seek, stream: %d ts: %lld (%lld/%lld)", seekIdx, ts, min, max);
+        ret = avformat_seek_file(mFormatCtx, seekIdx, min, ts, max, flags);
+        if (ret < 0) {
+            ALOGE("%s: error while seeking", mFormatCtx->filename);
+        }
+#if WAIT_KEY_PACKET_AFTER_SEEK
+        waitKey = true;
+#else
+        waitKey = mThumbnailMode;
+#endif
+    }
+
+    for (;;) {
+        ret = av_read_frame(mFormatCtx, pkt);
+        if (ret < 0) {
+            if (mFormatCtx->pb && mFormatCtx->pb->error) {
+                ALOGE("mFormatCtx->pb->error: %d", mFormatCtx->pb->error);
+            }
+            setIODeadline(0);
+            return -1;
+        }
+        if (pkt->stream_index != stream_index
+                || (waitKey && !(pkt->flags & AV_PKT_FLAG_KEY))) {
+            av_free_packet(pkt);
+            continue;
+        }
+        if (stream_index == mAudioStreamIdx && !filter_audio_packet(pkt)) {
+            av_free_packet(pkt);
+            continue;
+        }
+        setIODeadline(0);
+        return 1;
+    }
+}
+
+struct KeyFrameTarget {
+    size_t mOrder;      // index into the caller's list of times
+    int64_t mPos;       // file offset from the index, -1 if unknown
+    int64_t mTimestamp; // in stream time base
+};
+
+typedef int (*KeyFrameTargetCompare)(const KeyFrameTarget *a, const KeyFrameTarget *b);
+
+static int compareKeyFrameTargetsByTime(const KeyFrameTarget *a, const KeyFrameTarget *b)
+{
+    if (a->mTimestamp != b->mTimestamp) {
+        return a->mTimestamp < b->mTimestamp ? -1 : 1;
+    }
+    return 0;
+}
+
+// only when every target has a position
+static int compareKeyFrameTargetsByPos(const KeyFrameTarget *a, const KeyFrameTarget *b)
+{
+    if (a->mPos != b->mPos) {
+        return a->mPos < b->mPos ? -1 : 1;
+    }
+    return compareKeyFrameTargetsByTime(a, b);
+}
+
+static int findNearestKeyFrame(AVStream *st, int64_t ts)
+{
+    int prev = av_index_search_timestamp(st, ts, AVSEEK_FLAG_BACKWARD);
+    int next = av_index_search_timestamp(st, ts, 0);
+
+    if (prev < 0)
+        return next;
+    if (next < 0)
+        return prev;
+    return ts - st->index_entries[prev].timestamp
+            <= st->index_entries[next].timestamp - ts ? prev : next;
+}
+
+status_t FFmpegExtractor::readBatch(const sp<MediaSource> &track,
+        MediaBuffer **buffer, Vector<AccessUnitInfo> *units,
+        size_t maxUnits, int64_t maxDurationUs, size_t maxBytes,
+        const MediaSource::ReadOptions *options)
+{
+    FFmpegSource *source = static_cast<FFmpegSource *>(track.get());
+
+    CHECK(source != NULL && source->mExtractor.get() == this);
+
+    return source->readBatch(buffer, units, maxUnits, maxDurationUs, maxBytes, options);
+}
+
+status_t FFmpegExtractor::readKeyFrames(size_t index,
+        const Vector<int64_t> &timesUs, Vector<MediaBuffer *> *buffers)
+{
+    ALOGV("FFmpegExtractor::readKeyFrames[%d], %d times", index, timesUs.size());
+
+    if (mInitCheck != OK || index >= mTracks.size()) {
+        return BAD_VALUE;
+    }
+
+    sp<FFmpegSource> source = new FFmpegSource(this, index);
+
+    Mutex::Autolock _l(mLock);
+
+    if (mReaderThreadStarted) {
+        ALOGE("readKeyFrames: the reader thread is already running");
+        return INVALID_OPERATION;
+    }
+
+    int stream_index = mTracks.itemAt(index).mIndex;
+    AVStream *st = mFormatCtx->streams[stream_index];
+    Vector<KeyFrameTarget> targets;
+    size_t i = 0;
+
+    buffers->clear();
+    buffers->insertAt((MediaBuffer *)NULL, 0, timesUs.size());
+
+    KeyFrameTargetCompare compare = compareKeyFrameTargetsByPos;
+
+    // map every time to its keyframe in the container index, then visit
+    // them in file order, or in time order if any position is unknown
+    for (i = 0; i < timesUs.size(); i++) {
+        KeyFrameTarget target;
+        int64_t ts = av_rescale_q(timesUs[i], AV_TIME_BASE_Q, st->time_base);
+        if (st->start_time != AV_NOPTS_VALUE)
+            ts += st->start_time;
+
+        int e = findNearestKeyFrame(st, ts);
+        target.mOrder = i;
+        if (e >= 0) {
+            target.mPos = st->index_entries[e].pos;
+            target.mTimestamp = st->index_entries[e].timestamp;
+        } else {
+            target.mPos = -1;
+            target.mTimestamp = ts;
+        }
+        if (target.mPos < 0) {
+            compare = compareKeyFrameTargetsByTime;
+        }
+        targets.push(target);
+    }
+    targets.sort(compare);
+
+    for (i = 0; i < mFormatCtx->nb_streams; i++) {
+        mFormatCtx->streams[i]->discard =
+                (int)i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    AVPacket pkt, keep;
+    bool kept = false;
+    int64_t curPos = -1;
+    MediaBuffer *last = NULL;
+
+    for (i = 0; i < targets.size(); i++) {
+        const KeyFrameTarget &target = targets.itemAt(i);
+
+        if (kept && compare(&targets.itemAt(i - 1), &target) == 0) {
+            // several times map to the same keyframe, each caller's buffer
+            // is its own: convert a copy of the packet again
+            AVPacket dup;
+            last = NULL;
+            if (av_copy_packet(&dup, &keep) == 0) {
+                if (source->packetToMediaBuffer(&dup, &last) != OK) {
+                    last = NULL;
+                }
+                av_free_packet(&dup);
+            }
+            buffers->editItemAt(target.mOrder) = last;
+            continue;
+        }
+        if (kept) {
+            av_free_packet(&keep);
+            kept = false;
+        }
+
+        setIODeadline(READ_TIMEOUT_US);
+
+        // read through short gaps instead of seeking
+        if (target.mPos < 0 || curPos < 0 || target.mPos < curPos
+                || target.mPos - curPos > KEYFRAME_READ_THROUGH_SIZE) {
+            if (av_seek_frame(mFormatCtx, stream_index,
+                        target.mTimestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+                ALOGE("readKeyFrames: error while seeking to %lld", target.mTimestamp);
+                continue;
+            }
+        }
+
+        last = NULL;
+        while (av_read_frame(mFormatCtx, &pkt) >= 0) {
+            if (pkt.stream_index != stream_index
+                    || !(pkt.flags & AV_PKT_FLAG_KEY)
+                    || (target.mPos >= 0 && pkt.pos >= 0 && pkt.pos < target.mPos)) {
+                av_free_packet(&pkt);
+                continue;
+            }
+            // packetToMediaBuffer may convert pkt in place, keep the
+            // original while the next target wants the same keyframe
+            if (i + 1 < targets.size()
+                    && compare(&target, &targets.itemAt(i + 1)) == 0) {
+                kept = av_copy_packet(&keep, &pkt) == 0;
+            }
+            if (source->packetToMediaBuffer(&pkt, &last) != OK) {
+                last = NULL;
+            }
+            curPos = pkt.pos >= 0 ? pkt.pos + pkt.size : -1;
+            av_free_packet(&pkt);
+            break;
+        }
+        if (last == NULL) {
+            ALOGW("readKeyFrames: no keyframe for time %lld", timesUs[target.mOrder]);
+            curPos = -1;
+            continue;
+        }
+
+        buffers->editItemAt(target.mOrder) = last;
+    }
+    if (kept) {
+        av_free_packet(&keep);
+    }
+
+    setIODeadline(0);
+
+    // back to the state the thumbnail mode or the reader expects
+    for (i = 0; i < mFormatCtx->nb_streams; i++) {
+        bool active = mPullMode ? (int)i == mPullStreamIdx
+                : ((int)i == mAudioStreamIdx || (int)i == mVideoStreamIdx);
+        mFormatCtx->streams[i]->discard = active ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    return OK;
+}
+
+// staitc
+int FFmpegExtractor::decode_interrupt_cb(void *ctx)
+{
+    FFmpegExtractor *extractor = static_cast<FFmpegExtractor *>(ctx);
+
+    if (extractor->mAbortRequest) {
+        return 1;
+    }
+
+    // a source is waiting for the reader to seek, stop reading
+    if (extractor->mSeekIdx >= 0 && !extractor->mSeeking) {
+        return 1;
+    }
+
+    if (extractor->mIODeadline != AV_NOPTS_VALUE
+            && get_timestamp() > extractor->mIODeadline) {
+        ALOGW("I/O deadline expired");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* bound the next blocking demuxer calls, 0 clears the deadline */
+void FFmpegExtractor::setIODeadline(int64_t timeoutUs)
+{
+    mIODeadline = timeoutUs > 0 ? get_timestamp() + timeoutUs : AV_NOPTS_VALUE;
+}
+
+void FFmpegExtractor::fetchStuffsFromSniffedMeta(const sp<AMessage> &meta)
+{
+    AString url;
+    AString mime;
+    int32_t live = 0;
+
+    //url
+    CHECK(meta->findString("extended-extractor-url", &url));
+    CHECK(url.c_str() != NULL);
+    CHECK(url.size() < PATH_MAX);
+
+    memcpy(mFilename, url.c_str(), url.size());
+    mFilename[url.size()] = '\0';
+
+    //mime
+    CHECK(meta->findString("extended-extractor-mime", &mime));
+    CHECK(mime.c_str() != NULL);
+    mMeta->setCString(kKeyMIMEType, mime.c_str());
+
+    //live
+    if (!meta->findInt32("extended-extractor-live", &live)) {
+        live = isLiveUrl(mFilename) || isLiveUrl(mDataSource->getUri().string());
+    }
+    mLiveMode = live;
+    if (mLiveMode) {
+        ALOGI("live source, minimize probing and buffering");
+    }
+}
+
+/* schemes of sources that play in real time */
+bool FFmpegExtractor::isLiveUrl(const char *url)
+{
+    static const char *live_schemes[] = {
+        "rtsp:", "rtp:", "udp:", "mmsh:", "mmst:", "rtmp:",
+    };
+    size_t i;
+
+    if (!url)
+        return false;
+
+    for (i = 0; i < NELEM(live_schemes); i++) {
+        if (!strncasecmp(url, live_schemes[i], strlen(live_schemes[i])))
+            return true;
+    }
+    return false;
+}
+
+/* keep the queues of a live stream within LIVE_MAX_QUEUED_US, so that the
+ * packets are delivered with a bounded latency when the consumer lags
+ */
+void FFmpegExtractor::drop_late_packets()
+{
+    int dropped;
+
+    if (mVideoStreamIdx >= 0 && !mVideoStopped) {
+        AVStream *st = mFormatCtx->streams[mVideoStreamIdx];
+        dropped = packet_queue_drop_head(&mVideoQ,
+                av_rescale_q(LIVE_MAX_QUEUED_US, AV_TIME_BASE_Q, st->time_base), 1);
+        if (dropped > 0)
+            ALOGV("dropped %d late video packets", dropped);
+    }
+    if (mAudioStreamIdx >= 0 && !mAudioStopped) {
+        AVStream *st = mFormatCtx->streams[mAudioStreamIdx];
+        dropped = packet_queue_drop_head(&mAudioQ,
+                av_rescale_q(LIVE_MAX_QUEUED_US, AV_TIME_BASE_Q, st->time_base), 0);
+        if (dropped > 0)
+            ALOGV("dropped %d late audio packets", dropped);
+    }
+}
+
+void FFmpegExtractor::setFFmpegDefaultOpts()
+{
+    mGenPTS       = 0;
+#if DEBUG_DISABLE_VIDEO
+    mVideoDisable = 1;
+#else
+    mVideoDisable = 0;
+#endif
+#if DEBUG_DISABLE_AUDIO
+    mAudioDisable = 1;
+#else
+    mAudioDisable = 0;
+#endif
+    mShowStatus   = 0;
+    mSeekByBytes  = -1; /* seek by bytes 0=off 1=on -1=auto" */
+    mDuration     = AV_NOPTS_VALUE;
+    mSeekPos      = AV_NOPTS_VALUE;
+    mSeekTimeUs   = AV_NOPTS_VALUE;
+    mSeekMin      = INT64_MIN;
+    mSeekMax      = INT64_MAX;
+    mLoop         = 1;
+    mPeakQueuedSize = 0;
+
+    mVideoStreamIdx = -1;
+    mAudioStreamIdx = -1;
+    mVideoStream  = NULL;
+    mAudioStream  = NULL;
+    mDefersToCreateVideoTrack = false;
+    mDefersToCreateAudioTrack = false;
+    mVideoBsfc = NULL;
+    mAudioBsfc = NULL;
+    mAudioStripADTS = false;
+    mVideoStopped = false;
+    mAudioStopped = false;
+    mThumbnailMode = false;
+    mPullMode = false;
+    mPullStreamIdx = -1;
+
+    mAbortRequest = 0;
+    mPaused       = 0;
+    mLastPaused   = 0;
+    mProbePkts    = 0;
+    mEOF          = false;
+
+    mSeekIdx      = -1;
+    mSeeking      = false;
+    mIODeadline   = AV_NOPTS_VALUE;
+    mSeekMode     = MediaSource::ReadOptions::SEEK_CLOSEST_SYNC;
+    mSeekFlags    = AVSEEK_FLAG_BACKWARD;
+}
+
+int FFmpegExtractor::initStreams()
+{
+    int err = 0;
+    int i = 0;
+    status_t status = UNKNOWN_ERROR;
+    int eof = 0;
+    int ret = 0, audio_ret = -1, video_ret = -1;
+    int pkt_in_play_range = 0;
+    AVDictionaryEntry *t = NULL;
+    AVDictionary **opts = NULL;
+    int orig_nb_streams = 0;
+    bool skipTailEstimate = false;
+    int seekable = 0;
+    int st_index[AVMEDIA_TYPE_NB] = {0};
+    int wanted_stream[AVMEDIA_TYPE_NB] = {0};
+    st_index[AVMEDIA_TYPE_AUDIO]  = -1;
+    st_index[AVMEDIA_TYPE_VIDEO]  = -1;
+    wanted_stream[AVMEDIA_TYPE_AUDIO]  = -1;
+    wanted_stream[AVMEDIA_TYPE_VIDEO]  = -1;
+    const char *mime = NULL;
+
+    setFFmpegDefaultOpts();
+
+    status = initFFmpeg();
+    if (status != OK) {
+        ret = -1;
+        goto fail;
+    }
+    mFFmpegInited = true;
+
+    mFormatCtx = avformat_alloc_context();
+    if (!mFormatCtx)
+    {
+        ALOGE("oom for alloc avformat context");
+        ret = -1;
+        goto fail;
+    }
+    mFormatCtx->interrupt_callback.callback = decode_interrupt_cb;
+    mFormatCtx->interrupt_callback.opaque = this;
+    if (mLiveMode) {
+        // start from what arrives first rather than buffering to be sure
+        mFormatCtx->flags |= AVFMT_FLAG_NOBUFFER;
+        mFormatCtx->probesize = LIVE_PROBE_SIZE;
+        mFormatCtx->max_analyze_duration = LIVE_ANALYZE_DURATION_US;
+        mFormatCtx->max_delay = LIVE_MAX_DELAY_US;
+    }
+    ALOGV("mFilename: %s", mFilename);
+    setIODeadline(OPEN_TIMEOUT_US);
+    err = avformat_open_input(&mFormatCtx, mFilename, NULL, &format_opts);
+    if (err < 0) {
+        ALOGE("%s: avformat_open_input failed, err:%s", mFilename, av_err2str(err));
+        ret = -1;
+        goto fail;
+    }
+
+    if ((t = av_dict_get(format_opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+        ALOGE("Option %s not found.\n", t->key);
+        //ret = AVERROR_OPTION_NOT_FOUND;
+        ret = -1;
+        goto fail;
+    }
+
+    if (mGenPTS)
+        mFormatCtx->flags |= AVFMT_FLAG_GENPTS;
+
+    opts = setup_find_stream_info_opts(mFormatCtx, codec_opts);
+    orig_nb_streams = mFormatCtx->nb_streams;
+
+    /* for mpegts, avformat_find_stream_info would look for the last pts
+     * in up to 4 growing reads from the end of the file. Have it fall back
+     * to the bitrate instead, estimate_duration() replaces that guess from
+     * two windows. */
+    skipTailEstimate = !mLiveMode && mFormatCtx->pb
+            && !strcmp(mFormatCtx->iformat->name, "mpegts");
+    if (skipTailEstimate) {
+        seekable = mFormatCtx->pb->seekable;
+        mFormatCtx->pb->seekable = 0;
+    }
+    setIODeadline(OPEN_TIMEOUT_US);
+    err = avformat_find_stream_info(mFormatCtx, opts);
+    setIODeadline(0);
+    if (skipTailEstimate) {
+        mFormatCtx->pb->seekable = seekable;
+    }
+    if (err < 0) {
+        ALOGE("%s: could not find stream info, err:%s", mFilename, av_err2str(err));
+        ret = -1;
+        goto fail;
+    }
+    for (i = 0; i < orig_nb_streams; i++)
+        av_dict_free(&opts[i]);
+    av_freep(&opts);
+
+    if (mFormatCtx->pb)
+        mFormatCtx->pb->eof_reached = 0; // FIXME hack, ffplay maybe should not use url_feof() to test for the end
+
+    if (mSeekByBytes < 0)
+        mSeekByBytes = !!(mFormatCtx->iformat->flags & AVFMT_TS_DISCONT)
+            && strcmp("ogg", mFormatCtx->iformat->name)
+            && mFormatCtx->pb && mFormatCtx->pb->seekable;
+    ALOGV("seek by bytes: %d", mSeekByBytes);
+
+    for (i = 0; i < (int)mFormatCtx->nb_streams; i++)
         mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
     if (!mVideoDisable)
         st_index[AVMEDIA_TYPE_VIDEO] =
@@ -935,6 +1792,12 @@ int FFmpegExtractor::initStreams()
                                 wanted_stream[AVMEDIA_TYPE_AUDIO],
                                 st_index[AVMEDIA_TYPE_VIDEO],
                                 NULL, 0);
+    if (!mLiveMode) {
+        setIODeadline(OPEN_TIMEOUT_US);
+        estimate_duration();
+        setIODeadline(0);
+    }
+
     if (mShowStatus) {
         av_dump_format(mFormatCtx, 0, mFilename, 0);
     }
@@ -981,6 +1844,7 @@ int FFmpegExtractor::initStreams()
     ret = 0;
 
 fail:
+    setIODeadline(0);
     return ret;
 }
 
@@ -998,12 +1862,153 @@ void FFmpegExtractor::deInitStreams()
     }
 }
 
+/* create the deferred tracks, run the bitstream filters over a freshly
+ * demuxed packet and queue it. The packet is always consumed.
+ * Return < 0 on a fatal error.
+ */
+int FFmpegExtractor::queue_packet(AVPacket *pkt)
+{
+    if (pkt->stream_index == mVideoStreamIdx) {
+         if (mDefersToCreateVideoTrack) {
+            AVCodecContext *avctx = mFormatCtx->streams[mVideoStreamIdx]->codec;
+
+            int i = parser_split(avctx, pkt->data, pkt->size);
+            if (i > 0 && i < FF_MAX_EXTRADATA_SIZE) {
+                if (avctx->extradata)
+                    av_freep(&avctx->extradata);
+                avctx->extradata_size= i;
+                avctx->extradata = (uint8_t *)av_malloc(avctx->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+                if (!avctx->extradata) {
+                    av_free_packet(pkt);
+                    return AVERROR(ENOMEM);
+                }
+                // parameter sets (there may be sei in it)
+                memcpy(avctx->extradata, pkt->data, avctx->extradata_size);
+                memset(avctx->extradata + i, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+            } else {
+                av_free_packet(pkt);
+                return 0;
+            }
+
+            stream_component_open(mVideoStreamIdx);
+            if (!mDefersToCreateVideoTrack)
+                ALOGI("probe packet counter: %d when create video track ok", mProbePkts);
+            if (mProbePkts == EXTRACTOR_MAX_PROBE_PACKETS)
+                ALOGI("probe packet counter to max: %d, create video track: %d",
+                    mProbePkts, !mDefersToCreateVideoTrack);
+        }
+    } else if (pkt->stream_index == mAudioStreamIdx) {
+        AVCodecContext *avctx = mFormatCtx->streams[mAudioStreamIdx]->codec;
+        if (mDefersToCreateAudioTrack && mAudioBsfc
+                && avctx->codec_id == AV_CODEC_ID_AAC && avctx->extradata_size <= 0
+                && setup_aac_extradata(&avctx->extradata, &avctx->extradata_size,
+                        pkt->data, pkt->size)) {
+            // the config is set, only the headers are left to strip
+            ALOGI("built aac extradata from the first ADTS header");
+            av_bitstream_filter_close(mAudioBsfc);
+            mAudioBsfc = NULL;
+            mAudioStripADTS = true;
+        }
+        if (!filter_audio_packet(pkt)) {
+            av_free_packet(pkt);
+            return 0;
+        }
+        if (mDefersToCreateAudioTrack) {
+            if (avctx->extradata_size <= 0) {
+                av_free_packet(pkt);
+                return 0;
+            }
+            stream_component_open(mAudioStreamIdx);
+            if (!mDefersToCreateAudioTrack)
+                ALOGI("probe packet counter: %d when create audio track ok", mProbePkts);
+            if (mProbePkts == EXTRACTOR_MAX_PROBE_PACKETS)
+                ALOGI("probe packet counter to max: %d, create audio track: %d",
+                    mProbePkts, !mDefersToCreateAudioTrack);
+        }
+    }
+
+    if (pkt->stream_index == mAudioStreamIdx && !mAudioStopped) {
+        packet_queue_put(&mAudioQ, pkt);
+    } else if (pkt->stream_index == mVideoStreamIdx && !mVideoStopped) {
+        packet_queue_put(&mVideoQ, pkt);
+    } else {
+        av_free_packet(pkt);
+    }
+
+    return 0;
+}
+
+/* read packets on the calling thread until the deferred tracks are created,
+ * bounded by EXTRACTOR_MAX_PROBE_PACKETS and PROBE_TIMEOUT_US. The probed
+ * packets stay queued for the sources.
+ * Return < 0 if the demuxer could not be brought back to a usable state.
+ */
+int FFmpegExtractor::probe_deferred_tracks()
+{
+    AVPacket pkt1, *pkt = &pkt1;
+    int ret = 0;
+
+    setIODeadline(PROBE_TIMEOUT_US);
+
+    while (mProbePkts <= EXTRACTOR_MAX_PROBE_PACKETS &&
+            (mDefersToCreateVideoTrack || mDefersToCreateAudioTrack)) {
+        ret = av_read_frame(mFormatCtx, pkt);
+        mProbePkts++;
+        if (ret < 0) {
+            break;
+        }
+        if (queue_packet(pkt) < 0) {
+            break;
+        }
+    }
+
+    setIODeadline(0);
+
+    ALOGV("mProbePkts: %d, ret: %d, pb->error(if has): %d, mDefersToCreateVideoTrack: %d, mDefersToCreateAudioTrack: %d",
+        mProbePkts, ret, mFormatCtx->pb ? mFormatCtx->pb->error : 0, mDefersToCreateVideoTrack, mDefersToCreateAudioTrack);
+
+    if (ret == AVERROR_EXIT) {
+        /* the deadline expired, possibly halfway through a packet. Drop
+         * what was probed and start over from the beginning, the seek
+         * resets the demuxer */
+        ALOGW("probe interrupted, seek back to the start");
+        packet_queue_flush(&mAudioQ);
+        packet_queue_flush(&mVideoQ);
+        if (mFormatCtx->pb) {
+            mFormatCtx->pb->eof_reached = 0;
+            mFormatCtx->pb->error = 0;
+        }
+        ret = avformat_seek_file(mFormatCtx, -1, INT64_MIN,
+                mFormatCtx->start_time != AV_NOPTS_VALUE ? mFormatCtx->start_time : 0,
+                INT64_MAX, 0);
+        if (ret < 0) {
+            ALOGE("%s: error while seeking", mFormatCtx->filename);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 status_t FFmpegExtractor::startReaderThread() {
     ALOGV("Starting reader thread");
+    Mutex::Autolock autoLock(mLock);
 
     if (mReaderThreadStarted)
         return OK;
 
+    if (mPullMode) {
+        // another track is wanted, back to the queues
+        ALOGV("leave pull mode");
+        mThumbnailMode = false;
+        mPullMode = false;
+        mPullStreamIdx = -1;
+        if (mAudioStreamIdx >= 0)
+            mFormatCtx->streams[mAudioStreamIdx]->discard = AVDISCARD_DEFAULT;
+        if (mVideoStreamIdx >= 0)
+            mFormatCtx->streams[mVideoStreamIdx]->discard = AVDISCARD_DEFAULT;
+    }
+
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -1019,6 +2024,7 @@ status_t FFmpegExtractor::startReaderThread() {
     return OK;
 }
 
+/* called without mLock, which a starting reader takes first */
 void FFmpegExtractor::stopReaderThread() {
     ALOGV("Stopping reader thread");
 
@@ -1027,8 +2033,12 @@ void FFmpegExtractor::stopReaderThread() {
         return;
     }
 
-    mAbortRequest = 1;
-    mCondition.signal();
+    {
+        Mutex::Autolock autoLock(mLock);
+        mAbortRequest = 1;
+        mCondition.signal();
+        mSeekCondition.broadcast();
+    }
 
     /* close each stream */
     if (mAudioStreamIdx >= 0)
@@ -1061,10 +2071,8 @@ void FFmpegExtractor::readerEntry() {
 
     mLock.lock();
 
-    pid_t tid  = gettid();
-    androidSetThreadPriority(tid,
+    apply_thread_policy(THREAD_ROLE_READER,
             mVideoStreamIdx >= 0 ? ANDROID_PRIORITY_NORMAL : ANDROID_PRIORITY_AUDIO);
-    prctl(PR_SET_NAME, (unsigned long)"FFmpegExtractor Thread", 0, 0, 0);
 
     ALOGV("FFmpegExtractor wait for signal");
     while (!mReaderThreadStarted && !mAbortRequest) {
@@ -1079,6 +2087,10 @@ void FFmpegExtractor::readerEntry() {
     mVideoEOSReceived = false;
     mAudioEOSReceived = false;
 
+    // the last read was cut short for a seek, the demuxer is only sane
+    // again once that seek succeeds
+    bool interrupted = false;
+
     while (!mAbortRequest) {
 
         if (mPaused != mLastPaused) {
@@ -1092,9 +2104,11 @@ void FFmpegExtractor::readerEntry() {
         if (mPaused &&
                 (!strcmp(mFormatCtx->iformat->name, "rtsp") ||
                  (mFormatCtx->pb && !strncmp(mFilename, "mmsh:", 5)))) {
-            /* wait 10 ms to avoid trying to get another packet */
-            /* XXX: horrible */
-            usleep(10000);
+            /* wait 10 ms to avoid trying to get another packet,
+             * unless a seek or stop comes first */
+            mExtractorMutex.lock();
+            mCondition.waitRelative(mExtractorMutex, milliseconds(10));
+            mExtractorMutex.unlock();
             continue;
         }
 #endif
@@ -1102,28 +2116,51 @@ void FFmpegExtractor::readerEntry() {
         if (mSeekIdx >= 0) {
             Mutex::Autolock _l(mLock);
             ALOGV("readerEntry, mSeekIdx: %d mSeekPos: %lld (%lld/%lld)", mSeekIdx, mSeekPos, mSeekMin, mSeekMax);
-            ret = avformat_seek_file(mFormatCtx, mSeekIdx, mSeekMin, mSeekPos, mSeekMax, AVSEEK_FLAG_BACKWARD);
+            mSeeking = true;
+            ret = avformat_seek_file(mFormatCtx,
+                    (mSeekFlags & AVSEEK_FLAG_BYTE) ? -1 : mSeekIdx,
+                    mSeekMin, mSeekPos, mSeekMax, mSeekFlags);
+            mSeeking = false;
             if (ret < 0) {
                 ALOGE("%s: error while seeking", mFormatCtx->filename);
+                if (interrupted) {
+                    // release the waiting sources, they get what is left
+                    // in the queues and then the end of stream
+                    mSeekIdx = -1;
+                    mSeekCondition.broadcast();
+                    if (mVideoStreamIdx >= 0 && !mVideoStopped) {
+                        packet_queue_put_nullpacket(&mVideoQ, mVideoStreamIdx);
+                    }
+                    if (mAudioStreamIdx >= 0 && !mAudioStopped) {
+                        packet_queue_put_nullpacket(&mAudioQ, mAudioStreamIdx);
+                    }
+                    break;
+                }
             } else {
-                if (mAudioStreamIdx >= 0) {
+                if (mAudioStreamIdx >= 0 && !mAudioStopped) {
                     packet_queue_flush(&mAudioQ);
                     packet_queue_put(&mAudioQ, &mAudioQ.flush_pkt);
                 }
-                if (mVideoStreamIdx >= 0) {
+                if (mVideoStreamIdx >= 0 && !mVideoStopped) {
                     packet_queue_flush(&mVideoQ);
                     packet_queue_put(&mVideoQ, &mVideoQ.flush_pkt);
                 }
             }
             mSeekIdx = -1;
             eof = false;
-            mCondition.signal();
+            interrupted = false;
+            mSeekCondition.broadcast();
         }
 
-        /* if the queue are full, no need to read more */
+        if (mAudioQ.size + mVideoQ.size > mPeakQueuedSize)
+            mPeakQueuedSize = mAudioQ.size + mVideoQ.size;
+
+        /* if the queue are full, no need to read more. A live stream
+         * keeps coming regardless, it is read on and late packets dropped */
         if (   mAudioQ.size + mVideoQ.size > MAX_QUEUE_SIZE
-            || (   (mAudioQ   .size  > MIN_AUDIOQ_SIZE || mAudioStreamIdx < 0)
-                && (mVideoQ   .nb_packets > MIN_FRAMES || mVideoStreamIdx < 0))) {
+            || (  !mLiveMode
+                && (mAudioQ   .size  > MIN_AUDIOQ_SIZE || mAudioStreamIdx < 0 || mAudioStopped)
+                && (mVideoQ   .nb_packets > MIN_FRAMES || mVideoStreamIdx < 0 || mVideoStopped))) {
 #if DEBUG_READ_ENTRY
             ALOGV("readerEntry, full(wtf!!!), mVideoQ.size: %d, mVideoQ.nb_packets: %d, mAudioQ.size: %d, mAudioQ.nb_packets: %d",
                     mVideoQ.size, mVideoQ.nb_packets, mAudioQ.size, mAudioQ.nb_packets);
@@ -1136,10 +2173,10 @@ void FFmpegExtractor::readerEntry() {
         }
 
         if (eof) {
-            if (mVideoStreamIdx >= 0) {
+            if (mVideoStreamIdx >= 0 && !mVideoStopped) {
                 packet_queue_put_nullpacket(&mVideoQ, mVideoStreamIdx);
             }
-            if (mAudioStreamIdx >= 0) {
+            if (mAudioStreamIdx >= 0 && !mAudioStopped) {
                 packet_queue_put_nullpacket(&mAudioQ, mAudioStreamIdx);
             }
             /* wait 10 ms */
@@ -1152,6 +2189,17 @@ void FFmpegExtractor::readerEntry() {
 
         ret = av_read_frame(mFormatCtx, pkt);
 
+        if (ret < 0 && mSeekIdx >= 0 && !mAbortRequest) {
+            // interrupted for a seek, the seek resets the demuxer
+            ALOGV("read interrupted by seek");
+            interrupted = true;
+            if (mFormatCtx->pb) {
+                mFormatCtx->pb->eof_reached = 0;
+                mFormatCtx->pb->error = 0;
+            }
+            continue;
+        }
+
         mProbePkts++;
         if (ret < 0) {
             mEOF = true;
@@ -1167,74 +2215,11 @@ void FFmpegExtractor::readerEntry() {
             continue;
         }
 
-        if (pkt->stream_index == mVideoStreamIdx) {
-             if (mDefersToCreateVideoTrack) {
-                AVCodecContext *avctx = mFormatCtx->streams[mVideoStreamIdx]->codec;
-
-                int i = parser_split(avctx, pkt->data, pkt->size);
-                if (i > 0 && i < FF_MAX_EXTRADATA_SIZE) {
-                    if (avctx->extradata)
-                        av_freep(&avctx->extradata);
-                    avctx->extradata_size= i;
-                    avctx->extradata = (uint8_t *)av_malloc(avctx->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
-                    if (!avctx->extradata) {
-                        //return AVERROR(ENOMEM);
-                        ret = AVERROR(ENOMEM);
-                        goto fail;
-                    }
-                    // sps + pps(there may be sei in it)
-                    memcpy(avctx->extradata, pkt->data, avctx->extradata_size);
-                    memset(avctx->extradata + i, 0, FF_INPUT_BUFFER_PADDING_SIZE);
-                } else {
-                    av_free_packet(pkt);
-                    continue;
-                }
-
-                stream_component_open(mVideoStreamIdx);
-                if (!mDefersToCreateVideoTrack)
-                    ALOGI("probe packet counter: %d when create video track ok", mProbePkts);
-                if (mProbePkts == EXTRACTOR_MAX_PROBE_PACKETS)
-                    ALOGI("probe packet counter to max: %d, create video track: %d",
-                        mProbePkts, !mDefersToCreateVideoTrack);
-            }
-        } else if (pkt->stream_index == mAudioStreamIdx) {
-            int ret;
-            uint8_t *outbuf;
-            int   outbuf_size;
-            AVCodecContext *avctx = mFormatCtx->streams[mAudioStreamIdx]->codec;
-            if (mAudioBsfc && pkt && pkt->data) {
-                ret = av_bitstream_filter_filter(mAudioBsfc, avctx, NULL, &outbuf, &outbuf_size,
-                                   pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
-
-                if (ret < 0 ||!outbuf_size) {
-                    av_free_packet(pkt);
-                    continue;
-                }
-                if (outbuf && outbuf != pkt->data) {
-                    memmove(pkt->data, outbuf, outbuf_size);
-                    pkt->size = outbuf_size;
-                }
-            }
-            if (mDefersToCreateAudioTrack) {
-                if (avctx->extradata_size <= 0) {
-                    av_free_packet(pkt);
-                    continue;
-                }
-                stream_component_open(mAudioStreamIdx);
-                if (!mDefersToCreateAudioTrack)
-                    ALOGI("probe packet counter: %d when create audio track ok", mProbePkts);
-                if (mProbePkts == EXTRACTOR_MAX_PROBE_PACKETS)
-                    ALOGI("probe packet counter to max: %d, create audio track: %d",
-                        mProbePkts, !mDefersToCreateAudioTrack);
-            }
+        if (queue_packet(pkt) < 0) {
+            goto fail;
         }
-
-        if (pkt->stream_index == mAudioStreamIdx) {
-            packet_queue_put(&mAudioQ, pkt);
-        } else if (pkt->stream_index == mVideoStreamIdx) {
-            packet_queue_put(&mVideoQ, pkt);
-        } else {
-            av_free_packet(pkt);
+        if (mLiveMode) {
+            drop_late_packets();
         }
     }
 
@@ -1251,6 +2236,7 @@ FFmpegSource::FFmpegSource(
     : mExtractor(extractor),
       mTrackIndex(index),
       mIsAVC(false),
+      mIsHEVC(false),
       mNal2AnnexB(false),
       mStream(mExtractor->mTracks.itemAt(index).mStream),
       mQueue(mExtractor->mTracks.itemAt(index).mQueue) {
@@ -1281,28 +2267,70 @@ FFmpegSource::FFmpegSource(
             ALOGV("the stream is AVC, the length of a NAL unit: %d", mNALLengthSize);
 
             mNal2AnnexB = true;
+        } else if (getHVCCNalLengthSize(avctx)) {
+            mIsHEVC = true;
+            // The number of bytes used to encode the length of a NAL unit.
+            mNALLengthSize = getHVCCNalLengthSize(avctx);
+
+            ALOGV("the stream is HEVC, the length of a NAL unit: %d", mNALLengthSize);
+
+            mNal2AnnexB = true;
+        } else if (isHVCC(avctx)) {
+            ALOGW("can't convert HEVC NALs with %d byte lengths to annex b, "
+                    "pass the hvcC as is", 1 + (avctx->extradata[21] & 3));
         }
     }
 
     mMediaType = mStream->codec->codec_type;
     mFirstKeyPktTimestamp = AV_NOPTS_VALUE;
+    mQueueSerial = mQueue->serial;
+    mWaitKeyPkt = false;
+    mBufferPool = NULL;
+    mPendingSerial = 0;
+    mHasPendingPkt = false;
 }
 
 FFmpegSource::~FFmpegSource() {
     ALOGV("FFmpegSource::~FFmpegSource %s",
             av_get_media_type_string(mMediaType));
+    if (mHasPendingPkt) {
+        av_free_packet(&mPendingPkt);
+        mHasPendingPkt = false;
+    }
+    if (mBufferPool != NULL) {
+        mBufferPool->release();
+        mBufferPool = NULL;
+    }
     mExtractor = NULL;
 }
 
 status_t FFmpegSource::start(MetaData *params __unused) {
     ALOGV("FFmpegSource::start %s",
             av_get_media_type_string(mMediaType));
+
+    // buffers handed out before start(), e.g. thumbnails, are not pooled.
+    // media.ffmpeg.bufpool=0 turns the pool off, to benchmark without it
+    char value[PROPERTY_VALUE_MAX];
+    property_get("media.ffmpeg.bufpool", value, "1");
+    if (mBufferPool == NULL && atoi(value)) {
+        mBufferPool = new FFmpegBufferPool;
+    }
+
+    if (!mExtractor->isPullStream(mStream->index)) {
+        mExtractor->startReaderThread();
+    }
+    if (mExtractor->setStreamStopped(mStream->index, false)) {
+        // demuxing resumes wherever the other track is
+        mWaitKeyPkt = true;
+    }
     return OK;
 }
 
 status_t FFmpegSource::stop() {
     ALOGV("FFmpegSource::stop %s",
             av_get_media_type_string(mMediaType));
+
+    mExtractor->setStreamStopped(mStream->index, true);
     return OK;
 }
 
@@ -1312,37 +2340,180 @@ sp<MetaData> FFmpegSource::getFormat() {
 
 status_t FFmpegSource::read(
         MediaBuffer **buffer, const ReadOptions *options) {
+    AVPacket pkt;
+    status_t status = OK;
+
+    *buffer = NULL;
+
+    status = readPacket(&pkt, options);
+    if (status != OK) {
+        return status;
+    }
+
+    status = packetToMediaBuffer(&pkt, buffer);
+
+    av_free_packet(&pkt);
+
+    return status;
+}
+
+/* Read up to maxUnits access units, back to back into one buffer. The
+ * first one is read like read() does, the following ones only as long as
+ * they are already demuxed, of the same serial, within maxDurationUs of
+ * the first one and fit in maxBytes. The packet that ends the batch is
+ * kept for the next read.
+ */
+status_t FFmpegSource::readBatch(
+        MediaBuffer **buffer, Vector<FFmpegExtractor::AccessUnitInfo> *units,
+        size_t maxUnits, int64_t maxDurationUs, size_t maxBytes,
+        const ReadOptions *options) {
+    AVPacket pkt;
+    MediaBuffer *mediaBuffer = NULL;
+    FFmpegExtractor::AccessUnitInfo info;
+    int64_t firstTimeUs = AV_NOPTS_VALUE;
+    size_t offset = 0;
+    int serial = 0;
+    int ret = 0;
+    status_t status = OK;
+
     *buffer = NULL;
+    units->clear();
+
+    status = readPacket(&pkt, options);
+    if (status != OK) {
+        return status;
+    }
+
+    if (maxBytes < (size_t)pkt.size) {
+        maxBytes = pkt.size;
+    }
+    if (mBufferPool != NULL) {
+        mediaBuffer = mBufferPool->acquire(maxBytes + FF_INPUT_BUFFER_PADDING_SIZE);
+    }
+    if (mediaBuffer == NULL) {
+        mediaBuffer = new MediaBuffer(maxBytes + FF_INPUT_BUFFER_PADDING_SIZE);
+    }
+    mediaBuffer->meta_data()->clear();
+
+    firstTimeUs = packetTimeUs(&pkt);
+    mediaBuffer->meta_data()->setInt64(kKeyTime, firstTimeUs);
+    mediaBuffer->meta_data()->setInt32(kKeyIsSyncFrame,
+            pkt.flags & AV_PKT_FLAG_KEY ? 1 : 0);
+
+    for (;;) {
+        status = writePacketData(&pkt, (uint8_t *)mediaBuffer->data() + offset);
+        if (status != OK) {
+            av_free_packet(&pkt);
+            break;
+        }
+
+        info.mTimeUs = packetTimeUs(&pkt);
+        info.mOffset = offset;
+        info.mSize = pkt.size;
+        info.mIsSyncFrame = !!(pkt.flags & AV_PKT_FLAG_KEY);
+        units->push(info);
+        offset += pkt.size;
+        av_free_packet(&pkt);
+
+        if (units->size() >= maxUnits) {
+            break;
+        }
+
+        if (mExtractor->isPullStream(mStream->index)) {
+            ret = mExtractor->pull_read(mStream->index, AV_NOPTS_VALUE,
+                    ReadOptions::SEEK_CLOSEST_SYNC, &pkt);
+            serial = mQueueSerial;
+        } else {
+            ret = packet_queue_get(mQueue, &pkt, 0, &serial);
+        }
+        if (ret <= 0) {
+            break;
+        }
+
+        // leave flushes, eos and anything that does not fit to read()
+        if (serial != mQueueSerial
+                || pkt.data == mQueue->flush_pkt.data
+                || (pkt.data == NULL && pkt.size == 0)
+                || offset + pkt.size > maxBytes
+                || (maxDurationUs > 0 && firstTimeUs != SF_NOPTS_VALUE
+                    && packetTimeUs(&pkt) != SF_NOPTS_VALUE
+                    && packetTimeUs(&pkt) - firstTimeUs >= maxDurationUs)) {
+            mPendingPkt = pkt;
+            mPendingSerial = serial;
+            mHasPendingPkt = true;
+            break;
+        }
+    }
+
+    if (units->isEmpty()) {
+        mediaBuffer->release();
+        return status;
+    }
+
+    mediaBuffer->set_range(0, offset);
+    *buffer = mediaBuffer;
+
+    return OK;
+}
 
-    AVPacket pkt;
+status_t FFmpegSource::readPacket(AVPacket *pkt, const ReadOptions *options) {
     bool seeking = false;
-    bool waitKeyPkt = false;
-    ReadOptions::SeekMode mode;
+    bool waitKeyPkt = mWaitKeyPkt;
+    ReadOptions::SeekMode mode = ReadOptions::SEEK_CLOSEST_SYNC;
     int64_t pktTS = AV_NOPTS_VALUE;
     int64_t seekTimeUs = AV_NOPTS_VALUE;
-    int64_t timeUs = AV_NOPTS_VALUE;
     int key = 0;
-    status_t status = OK;
+    int serial = 0;
+    int seekSerial = mQueueSerial;
+    int ret = 0;
+    bool seekRequested = false;
 
     if (options && options->getSeekTo(&seekTimeUs, &mode)) {
         ALOGV("~~~%s seekTimeUs: %lld, mode: %d", av_get_media_type_string(mMediaType), seekTimeUs, mode);
-        /* add the stream start time */
-        if (mStream->start_time != AV_NOPTS_VALUE)
-            seekTimeUs += mStream->start_time * av_q2d(mStream->time_base) * 1000000;
-        ALOGV("~~~%s seekTimeUs[+startTime]: %lld, mode: %d", av_get_media_type_string(mMediaType), seekTimeUs, mode);
-        seeking = (mExtractor->stream_seek(seekTimeUs, mMediaType, mode) == SEEK);
+        seekRequested = true;
+    }
+
+    // the packet that ended the last batch
+    if (mHasPendingPkt) {
+        mHasPendingPkt = false;
+        if (!seekRequested) {
+            *pkt = mPendingPkt;
+            serial = mPendingSerial;
+            goto got_queued_packet;
+        }
+        av_free_packet(&mPendingPkt);
+    }
+
+    ret = mExtractor->pull_read(mStream->index,
+            seekRequested ? seekTimeUs : AV_NOPTS_VALUE, mode, pkt);
+    if (ret < 0) {
+        ALOGD("read %s pull eos", av_get_media_type_string(mMediaType));
+        return ERROR_END_OF_STREAM;
+    } else if (ret > 0) {
+        goto got_packet;
+    }
+
+    mExtractor->startReaderThread();
+    mWaitKeyPkt = false;
+
+    if (seekRequested) {
+        /* the extractor adds the start time of the stream it seeks on */
+        seeking = (mExtractor->stream_seek(seekTimeUs, mMediaType, mode, &seekSerial) == SEEK);
     }
 
 retry:
-    if (packet_queue_get(mQueue, &pkt, 1) < 0) {
+    if (packet_queue_get(mQueue, pkt, 1, &serial) < 0) {
         ALOGD("read %s abort reqeust", av_get_media_type_string(mMediaType));
         mExtractor->reachedEOS(mMediaType);
         return ERROR_END_OF_STREAM;
     }
 
+got_queued_packet:
+    mQueueSerial = serial;
+
     if (seeking) {
-        if (pkt.data != mQueue->flush_pkt.data) {
-            av_free_packet(&pkt);
+        if (serial != seekSerial) {
+            av_free_packet(pkt);
             goto retry;
         } else {
             seeking = false;
@@ -1352,25 +2523,26 @@ retry:
         }
     }
 
-    if (pkt.data == mQueue->flush_pkt.data) {
+    if (pkt->data == mQueue->flush_pkt.data) {
         ALOGV("read %s flush pkt", av_get_media_type_string(mMediaType));
-        av_free_packet(&pkt);
+        av_free_packet(pkt);
         mFirstKeyPktTimestamp = AV_NOPTS_VALUE;
         goto retry;
-    } else if (pkt.data == NULL && pkt.size == 0) {
+    } else if (pkt->data == NULL && pkt->size == 0) {
         ALOGD("read %s eos pkt", av_get_media_type_string(mMediaType));
-        av_free_packet(&pkt);
+        av_free_packet(pkt);
         mExtractor->reachedEOS(mMediaType);
         return ERROR_END_OF_STREAM;
     }
 
-    key = pkt.flags & AV_PKT_FLAG_KEY ? 1 : 0;
-    pktTS = pkt.pts == AV_NOPTS_VALUE ? pkt.dts : pkt.pts;
+got_packet:
+    key = pkt->flags & AV_PKT_FLAG_KEY ? 1 : 0;
+    pktTS = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
 
     if (waitKeyPkt) {
         if (!key) {
             ALOGV("drop the non-key packet");
-            av_free_packet(&pkt);
+            av_free_packet(pkt);
             goto retry;
         } else {
             ALOGV("~~~~~~ got the key packet");
@@ -1383,42 +2555,98 @@ retry:
         mFirstKeyPktTimestamp = pktTS;
     }
 
-    MediaBuffer *mediaBuffer = new MediaBuffer(pkt.size + FF_INPUT_BUFFER_PADDING_SIZE);
-    mediaBuffer->meta_data()->clear();
-    mediaBuffer->set_range(0, pkt.size);
+    return OK;
+}
+
+int64_t FFmpegSource::packetTimeUs(const AVPacket *pkt) {
+    int64_t pktTS = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t start_time = mStream->start_time != AV_NOPTS_VALUE ? mStream->start_time : 0;
+
+    if (pktTS == AV_NOPTS_VALUE)
+        return SF_NOPTS_VALUE; //FIXME AV_NOPTS_VALUE is negative, but stagefright need positive
+
+    return (pktTS - start_time) * av_q2d(mStream->time_base) * 1000000;
+}
+
+/* copy the packet payload to dst, in annex b if the track needs it */
+status_t FFmpegSource::writePacketData(const AVPacket *pkt, uint8_t *dst) {
+    status_t status = OK;
 
-    //copy data
-    if (mIsAVC && mNal2AnnexB) {
+    if ((mIsAVC || mIsHEVC) && mNal2AnnexB) {
         /* This only works for NAL sizes 3-4 */
         CHECK(mNALLengthSize == 3 || mNALLengthSize == 4);
 
-        uint8_t *dst = (uint8_t *)mediaBuffer->data();
-        /* Convert H.264 NAL format to annex b */
-        status = convertNal2AnnexB(dst, pkt.size, pkt.data, pkt.size, mNALLengthSize);
+        /* Convert H.264/HEVC NAL format to annex b */
+        status = convertNal2AnnexB(dst, pkt->size, pkt->data, pkt->size, mNALLengthSize);
         if (status != OK) {
             ALOGE("convertNal2AnnexB failed");
-            mediaBuffer->release();
-            mediaBuffer = NULL;
-            av_free_packet(&pkt);
             return ERROR_MALFORMED;
         }
     } else {
-        memcpy(mediaBuffer->data(), pkt.data, pkt.size);
+        memcpy(dst, pkt->data, pkt->size);
     }
+    return OK;
+}
 
-    int64_t start_time = mStream->start_time != AV_NOPTS_VALUE ? mStream->start_time : 0;
-    if (pktTS != AV_NOPTS_VALUE)
-        timeUs = (pktTS - start_time) * av_q2d(mStream->time_base) * 1000000;
-    else
-        timeUs = SF_NOPTS_VALUE; //FIXME AV_NOPTS_VALUE is negative, but stagefright need positive
+status_t FFmpegSource::packetToMediaBuffer(AVPacket *pkt, MediaBuffer **buffer) {
+    int64_t timeUs = AV_NOPTS_VALUE;
+    int key = pkt->flags & AV_PKT_FLAG_KEY ? 1 : 0;
+    status_t status = OK;
+
+    *buffer = NULL;
+
+    MediaBuffer *mediaBuffer = NULL;
+    /* always annex b, whatever the decoder: OMXCodec and ACodec give every
+     * decoder, OMX.ffmpeg included, the avcC/hvcC as start code prefixed
+     * parameter sets, so length prefixed frames would not decode */
+    bool needsCopy = (mIsAVC || mIsHEVC) && mNal2AnnexB;
+
+    if (needsCopy && mNALLengthSize == 4
+            && pkt->buf && av_buffer_is_writable(pkt->buf)) {
+        /* the start codes take the place of the lengths, nothing moves */
+        status = convertNal2AnnexBInPlace(pkt->data, pkt->size);
+        if (status != OK) {
+            ALOGE("convertNal2AnnexBInPlace failed");
+            return ERROR_MALFORMED;
+        }
+        needsCopy = false;
+    }
+
+    // hand the packet payload out as is
+    if (!needsCopy && pkt->buf) {
+        mediaBuffer = FFmpegPacketBuffer::create(pkt);
+    }
+
+    if (mediaBuffer == NULL) {
+        if (mBufferPool != NULL) {
+            mediaBuffer = mBufferPool->acquire(pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
+        }
+        if (mediaBuffer == NULL) {
+            mediaBuffer = new MediaBuffer(pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
+        }
+        mediaBuffer->set_range(0, pkt->size);
+
+        //copy data
+        status = writePacketData(pkt, (uint8_t *)mediaBuffer->data());
+        if (status != OK) {
+            mediaBuffer->release();
+            mediaBuffer = NULL;
+            return status;
+        }
+    }
+    mediaBuffer->meta_data()->clear();
+
+    timeUs = packetTimeUs(pkt);
 
 #if DEBUG_PKT
+    int64_t pktTS = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t start_time = mStream->start_time != AV_NOPTS_VALUE ? mStream->start_time : 0;
     if (pktTS != AV_NOPTS_VALUE)
         ALOGV("read %s pkt, size:%d, key:%d, pktPTS: %lld, pts:%lld, dts:%lld, timeUs[-startTime]:%lld us (%.2f secs) start_time=%lld",
-            av_get_media_type_string(mMediaType), pkt.size, key, pktTS, pkt.pts, pkt.dts, timeUs, timeUs/1E6, start_time);
+            av_get_media_type_string(mMediaType), pkt->size, key, pktTS, pkt->pts, pkt->dts, timeUs, timeUs/1E6, start_time);
     else
         ALOGV("read %s pkt, size:%d, key:%d, pts:N/A, dts:N/A, timeUs[-startTime]:N/A",
-            av_get_media_type_string(mMediaType), pkt.size, key);
+            av_get_media_type_string(mMediaType), pkt->size, key);
 #endif
 
     mediaBuffer->meta_data()->setInt64(kKeyTime, timeUs);
@@ -1426,13 +2654,110 @@ retry:
 
     *buffer = mediaBuffer;
 
-    av_free_packet(&pkt);
-
     return OK;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+FFmpegBufferPool::~FFmpegBufferPool() {
+    CHECK(mBuffers.isEmpty());
+}
+
+// with mLock held, the buffer must not be in use
+void FFmpegBufferPool::freeBuffer(MediaBuffer *buffer) {
+    for (size_t i = 0; i < mBuffers.size(); i++) {
+        if (mBuffers.itemAt(i) == buffer) {
+            mBuffers.removeAt(i);
+            break;
+        }
+    }
+    buffer->setObserver(NULL);
+    buffer->release();
+}
+
+void FFmpegBufferPool::release() {
+    bool empty;
+
+    mLock.lock();
+    mReleased = true;
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        for (size_t j = 0; j < mFreeBuffers[i].size(); j++) {
+            freeBuffer(mFreeBuffers[i].itemAt(j));
+        }
+        mFreeBuffers[i].clear();
+    }
+    empty = mBuffers.isEmpty();
+    if (!empty) {
+        ALOGV("buffer pool released with %d buffers out", mBuffers.size());
+    }
+    mLock.unlock();
+
+    if (empty) {
+        delete this;
+    }
+}
+
+int FFmpegBufferPool::sizeClass(size_t size) {
+    int cls = 0;
+
+    while ((size_t)1 << (cls + BUFFER_POOL_MIN_SHIFT) < size) {
+        if (++cls == BUFFER_POOL_CLASSES)
+            return -1;
+    }
+    return cls;
+}
+
+MediaBuffer *FFmpegBufferPool::acquire(size_t size) {
+    MediaBuffer *buffer = NULL;
+    int cls = sizeClass(size);
+
+    if (cls < 0) {
+        return NULL;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    for (int i = cls; i < BUFFER_POOL_CLASSES; i++) {
+        if (!mFreeBuffers[i].isEmpty()) {
+            buffer = mFreeBuffers[i].top();
+            mFreeBuffers[i].pop();
+            break;
+        }
+    }
+
+    if (buffer == NULL) {
+        buffer = new MediaBuffer((size_t)1 << (cls + BUFFER_POOL_MIN_SHIFT));
+        buffer->setObserver(this);
+        mBuffers.push(buffer);
+        ALOGV("buffer pool grows to %d buffers, new one of %d bytes",
+                mBuffers.size(), buffer->size());
+    }
+
+    buffer->add_ref();
+    return buffer;
+}
+
+void FFmpegBufferPool::signalBufferReturned(MediaBuffer *buffer) {
+    bool empty;
+
+    mLock.lock();
+    if (!mReleased) {
+        // only whole classes are allocated, the size is exact
+        mFreeBuffers[sizeClass(buffer->size())].push(buffer);
+        mLock.unlock();
+        return;
+    }
+    freeBuffer(buffer);
+    empty = mBuffers.isEmpty();
+    mLock.unlock();
+
+    if (empty) {
+        delete this;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 typedef struct {
     const char *format;
     const char *container;
@@ -1794,6 +3119,51 @@ static const char *findMatchingContainer(const char *name)
     return container;
 }
 
+/* demuxers that set every stream's codec for good while reading the
+ * header (moov, Tracks), which is all the confidence helpers look at.
+ * avi and asf are left out: they may name a codec the stream info probe
+ * then replaces from the packets (PCM that carries DTS, dvr-ms audio) */
+static const char *HEADER_CODEC_FORMATS[] = {
+        "mov,mp4,m4a,3gp,3g2,mj2",
+        "matroska,webm",
+};
+
+static bool hasCodecsFromHeader(AVFormatContext *ic)
+{
+    char value[PROPERTY_VALUE_MAX];
+    size_t i;
+    bool found = false;
+
+    // media.ffmpeg.sniff.header=0 always probes, to benchmark without it
+    property_get("media.ffmpeg.sniff.header", value, "1");
+    if (!atoi(value)) {
+        return false;
+    }
+
+    for (i = 0; i < NELEM(HEADER_CODEC_FORMATS); i++) {
+        if (!strcmp(ic->iformat->name, HEADER_CODEC_FORMATS[i])) {
+            found = true;
+            break;
+        }
+    }
+    if (!found || ic->nb_streams == 0) {
+        return false;
+    }
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVCodecContext *avctx = ic->streams[i]->codec;
+        if (ic->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+            continue;
+        }
+        if (avctx->codec_type == AVMEDIA_TYPE_UNKNOWN
+                || avctx->codec_id == AV_CODEC_ID_NONE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool fastMPEG4)
 {
     int err = 0;
@@ -1833,17 +3203,21 @@ static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool fa
         }
     }
 
-    opts = setup_find_stream_info_opts(ic, codec_opts);
-    nb_streams = ic->nb_streams;
-    err = avformat_find_stream_info(ic, opts);
-    if (err < 0) {
-        ALOGE("%s: could not find stream info, err:%s", url, av_err2str(err));
-        goto fail;
-    }
-    for (i = 0; i < nb_streams; i++) {
-        av_dict_free(&opts[i]);
+    if (hasCodecsFromHeader(ic)) {
+        ALOGV("%s: codecs known from the header, no stream info needed", url);
+    } else {
+        opts = setup_find_stream_info_opts(ic, codec_opts);
+        nb_streams = ic->nb_streams;
+        err = avformat_find_stream_info(ic, opts);
+        if (err < 0) {
+            ALOGE("%s: could not find stream info, err:%s", url, av_err2str(err));
+            goto fail;
+        }
+        for (i = 0; i < nb_streams; i++) {
+            av_dict_free(&opts[i]);
+        }
+        av_freep(&opts);
     }
-    av_freep(&opts);
 
     av_dump_format(ic, 0, url, 0);
 
@@ -1867,6 +3241,273 @@ fail:
     return container;
 }
 
+/* the only logical stream of an ogg file starting with this BOS page */
+static const uint8_t *oggSingleStreamPayload(const uint8_t *buf, size_t size)
+{
+    size_t nsegs, payload = 0, next, i;
+
+    if (size < 27 || memcmp(buf, "OggS", 4) || !(buf[5] & 0x02)) {
+        return NULL;
+    }
+    nsegs = buf[26];
+    if (27 + nsegs > size) {
+        return NULL;
+    }
+    for (i = 0; i < nsegs; i++) {
+        payload += buf[27 + i];
+    }
+    next = 27 + nsegs + payload;
+    // all BOS pages come first, a second one means several streams
+    if (next + 6 > size || memcmp(buf + next, "OggS", 4)
+            || (buf[next + 5] & 0x02)) {
+        return NULL;
+    }
+    return buf + 27 + nsegs;
+}
+
+static bool isStagefrightWavFormat(const uint8_t *buf, size_t size)
+{
+    size_t pos = 12;
+
+    while (pos + 8 <= size) {
+        const uint8_t *fmt = buf + pos + 8;
+        uint32_t len = AV_RL32(buf + pos + 4);
+        unsigned tag, channels, bits;
+
+        if (memcmp(buf + pos, "fmt ", 4)) {
+            if (len >= size) {
+                return false;
+            }
+            pos += 8 + len + (len & 1);
+            continue;
+        }
+        if (len < 16 || pos + 8 + 16 > size) {
+            return false;
+        }
+        tag = AV_RL16(fmt);
+        channels = AV_RL16(fmt + 2);
+        bits = AV_RL16(fmt + 14);
+        if (tag == 0xFFFE && len >= 40 && pos + 8 + 40 <= size) {
+            tag = AV_RL16(fmt + 24); // WAVE_FORMAT_EXTENSIBLE subformat
+        }
+        switch (tag) {
+        case 0x0001: // pcm
+            // 16 bit stereo may be IEC 61937 (dts/ac3 in wav) that only
+            // the probe finds out
+            return (bits == 8 || bits == 16 || bits == 24)
+                    && !(bits == 16 && channels == 2);
+        case 0x0006: // alaw
+        case 0x0007: // mulaw
+        case 0x0031: // gsm ms
+            return true;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+/* the codec the mpegts demuxer settles on for a PMT stream type, none
+ * for the types whose codec is only known from descriptors or packets */
+static bool tsStreamCodec(int stream_type, AVMediaType *type, AVCodecID *codec_id)
+{
+    switch (stream_type) {
+    case 0x01: // mpeg1 video, which sniffs the same
+    case 0x02:
+        *codec_id = AV_CODEC_ID_MPEG2VIDEO;
+        break;
+    case 0x10:
+        *codec_id = AV_CODEC_ID_MPEG4;
+        break;
+    case 0x1b:
+        *codec_id = AV_CODEC_ID_H264;
+        break;
+    case 0x24:
+        *codec_id = AV_CODEC_ID_HEVC;
+        break;
+    case 0x0f:
+        *codec_id = AV_CODEC_ID_AAC;
+        break;
+    case 0x11:
+        *codec_id = AV_CODEC_ID_AAC_LATM;
+        break;
+    default:
+        return false;
+    }
+    *type = avcodec_get_type(*codec_id);
+    return true;
+}
+
+/* the section starting in this ts packet, if it ends there as well */
+static const uint8_t *tsSection(const uint8_t *pkt, int *pid, int *size)
+{
+    int pos = 4, len;
+
+    if (pkt[0] != 0x47 || !(pkt[1] & 0x40) || !(pkt[3] & 0x10)) {
+        return NULL;
+    }
+    *pid = (pkt[1] & 0x1f) << 8 | pkt[2];
+    if (pkt[3] & 0x20) {
+        pos += 1 + pkt[4]; // adaptation field
+    }
+    if (pos >= 188) {
+        return NULL;
+    }
+    pos += 1 + pkt[pos]; // pointer field
+    if (pos + 3 > 188) {
+        return NULL;
+    }
+    len = 3 + ((pkt[pos + 1] & 0x0f) << 8 | pkt[pos + 2]);
+    if (len < 12 + 4 || pos + len > 188) {
+        return NULL;
+    }
+    *size = len - 4; // without the crc
+    return pkt + pos;
+}
+
+/*
+ * Fill ic with the streams of a transport stream's only program, as the
+ * mpegts demuxer would create them from its PMT: same order, same codecs.
+ * Fails unless the file is 188 or 192 byte packets all through buf, and
+ * the PAT and PMT are found there, each in one packet, with no stream
+ * whose codec needs probing.
+ */
+static bool tsProgramStreams(const uint8_t *buf, size_t size, AVFormatContext *ic)
+{
+    size_t stride, prefix, off;
+    int pmt_pid = -1;
+
+    if (size > 4 && buf[0] == 0x47) {
+        stride = 188;
+        prefix = 0;
+    } else if (size > 4 && buf[4] == 0x47) {
+        stride = 192; // m2ts, with a 4 byte timestamp first
+        prefix = 4;
+    } else {
+        return false;
+    }
+    if (size < 8 * stride) {
+        return false;
+    }
+    for (off = prefix; off < size; off += stride) {
+        if (buf[off] != 0x47) {
+            return false;
+        }
+    }
+
+    for (off = prefix; off + 188 <= size; off += stride) {
+        const uint8_t *sec;
+        int pid, len, pos;
+
+        sec = tsSection(buf + off, &pid, &len);
+        if (!sec) {
+            continue;
+        }
+        if (pid == 0 && sec[0] == 0x00 && pmt_pid < 0) {
+            for (pos = 8; pos + 4 <= len; pos += 4) {
+                if (AV_RB16(sec + pos) == 0) {
+                    continue; // network PID
+                }
+                if (pmt_pid >= 0) {
+                    return false; // several programs, let the probe pick
+                }
+                pmt_pid = AV_RB16(sec + pos + 2) & 0x1fff;
+            }
+        } else if (pid == pmt_pid && sec[0] == 0x02) {
+            pos = 12 + ((sec[10] & 0x0f) << 8 | sec[11]);
+            while (pos + 5 <= len) {
+                AVMediaType type;
+                AVCodecID codec_id;
+                AVStream *st;
+
+                if (!tsStreamCodec(sec[pos], &type, &codec_id)
+                        || !(st = avformat_new_stream(ic, NULL))) {
+                    return false;
+                }
+                st->codec->codec_type = type;
+                st->codec->codec_id = codec_id;
+                pos += 5 + ((sec[pos + 3] & 0x0f) << 8 | sec[pos + 4]);
+            }
+            return ic->nb_streams > 0;
+        }
+    }
+    return false;
+}
+
+/* the sniff result of a transport stream, from the streams of its PMT */
+static const char *tsPreSniff(const uint8_t *buf, size_t size, float *confidence)
+{
+    AVFormatContext *ic = avformat_alloc_context();
+    const char *container = NULL;
+
+    if (ic && tsProgramStreams(buf, size, ic)) {
+        container = MEDIA_MIMETYPE_CONTAINER_MPEG2TS;
+        adjustContainerIfNeeded(&container, ic);
+        adjustConfidenceIfNeeded(container, ic, confidence);
+    }
+    avformat_free_context(ic);
+    return container;
+}
+
+/*
+ * Classify the source from its first bytes, for the formats whose sniff
+ * result can be told from the header alone: the codec is fixed by the
+ * container or found in the first page or PMT. An mp4 on a caching source
+ * is declined by SniffFFMPEG whatever its codecs, so its ftyp is enough.
+ * Formats whose confidence depends on codecs deeper in the file (local
+ * mp4, mkv/webm, avi, ...) return NULL and go through the full probe.
+ */
+static const char *PreSniffFFMPEG(const sp<DataSource> &source,
+        float *confidence, sp<AMessage> meta)
+{
+    uint8_t buf[PRESNIFF_SIZE];
+    const uint8_t *payload;
+    const char *ret = NULL;
+    char url[PATH_MAX] = {0};
+    ssize_t n;
+
+    n = source->readAt(0, buf, sizeof(buf));
+    if (n < 12) {
+        return NULL;
+    }
+
+    if (!memcmp(buf, "fLaC", 4)) {
+        ret = MEDIA_MIMETYPE_AUDIO_FLAC;
+    } else if (!memcmp(buf, "MAC ", 4)) {
+        ret = MEDIA_MIMETYPE_AUDIO_APE;
+        *confidence = 0.88f;
+    } else if (!memcmp(buf, "#!AMR\n", 6) || !memcmp(buf, "#!AMR-WB\n", 9)) {
+        ret = MEDIA_MIMETYPE_AUDIO_FFMPEG;
+    } else if (!memcmp(buf, "RIFF", 4) && !memcmp(buf + 8, "WAVE", 4)) {
+        if (isStagefrightWavFormat(buf, n)) {
+            ret = MEDIA_MIMETYPE_CONTAINER_WAV;
+        }
+    } else if ((payload = oggSingleStreamPayload(buf, n)) != NULL
+            && payload + 8 <= buf + n) {
+        if (!memcmp(payload, "\x01vorbis", 7)) {
+            ret = MEDIA_MIMETYPE_AUDIO_VORBIS;
+        } else if (!memcmp(payload, "OpusHead", 8)) {
+            ret = MEDIA_MIMETYPE_CONTAINER_OGG;
+            *confidence = 0.88f;
+        }
+    } else if (!memcmp(buf + 4, "ftyp", 4)) {
+        // what the fastMPEG4 shortcut of SniffFFMPEGCommon would return
+        if (source->flags() & DataSource::kIsCachingDataSource) {
+            ret = MEDIA_MIMETYPE_CONTAINER_MPEG4;
+        }
+    } else {
+        ret = tsPreSniff(buf, n, confidence);
+    }
+
+    if (ret) {
+        ALOGD("presniff detected '%s' with confidence %.2f", ret, *confidence);
+        snprintf(url, sizeof(url), "android-source:%p", source.get());
+        meta->setString("extended-extractor-url", url);
+    }
+
+    return ret;
+}
+
 static const char *BetterSniffFFMPEG(const sp<DataSource> &source,
         float *confidence, sp<AMessage> meta)
 {
@@ -1918,7 +3559,10 @@ bool SniffFFMPEG(
     *meta = new AMessage;
     *confidence = 0.08f;  // be the last resort, by default
 
-    const char *container = BetterSniffFFMPEG(source, confidence, *meta);
+    const char *container = PreSniffFFMPEG(source, confidence, *meta);
+    if (!container) {
+        container = BetterSniffFFMPEG(source, confidence, *meta);
+    }
     if (!container) {
         ALOGW("sniff through BetterSniffFFMPEG failed, try LegacySniffFFMPEG");
         container = LegacySniffFFMPEG(source, confidence, *meta);
@@ -1973,6 +3617,7 @@ bool SniffFFMPEG(
 MediaExtractor *CreateFFmpegExtractor(const sp<DataSource> &source, const char *mime, const sp<AMessage> &meta) {
     MediaExtractor *ret = NULL;
     AString notuse;
+
     if (meta.get() && meta->findString("extended-extractor", &notuse) && (
             !strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_MPEG)          ||
             !strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_AAC)           ||
@@ -44,6 +44,34 @@ struct FFmpegExtractor : public MediaExtractor {
 
     virtual uint32_t flags() const;
 
+    // Read the keyframe nearest to each of timesUs from the track in a
+    // single forward pass over the file. (*buffers)[i] is the keyframe for
+    // timesUs[i], or NULL if none could be read. Only valid before any
+    // FFmpegSource has been started.
+    status_t readKeyFrames(size_t index, const Vector<int64_t> &timesUs,
+            Vector<MediaBuffer *> *buffers);
+
+    struct AccessUnitInfo {
+        int64_t mTimeUs;
+        size_t mOffset;
+        size_t mSize;
+        bool mIsSyncFrame;
+    };
+
+    // Read several access units of a started track, as returned by
+    // getTrack(), into one buffer: up to maxUnits of them, within
+    // maxDurationUs of the first one and maxBytes in total. Only units
+    // already demuxed are added after the first. (*units)[i] locates the
+    // i-th unit in *buffer, whose own meta data describe the first one.
+    status_t readBatch(const sp<MediaSource> &track,
+            MediaBuffer **buffer, Vector<AccessUnitInfo> *units,
+            size_t maxUnits, int64_t maxDurationUs, size_t maxBytes,
+            const MediaSource::ReadOptions *options = NULL);
+
+    // Most bytes held in the packet queues at once since the reader
+    // thread started, for benchmarking.
+    size_t peakQueuedBytes() const;
+
 protected:
     virtual ~FFmpegExtractor();
 
@@ -62,6 +90,7 @@ private:
     mutable Mutex mLock;
     mutable Mutex mExtractorMutex;
     Condition mCondition;
+    Condition mSeekCondition;
 
     sp<DataSource> mDataSource;
     sp<MetaData> mMeta;
@@ -84,16 +113,23 @@ private:
     int mPaused;
     int mLastPaused;
     int mSeekIdx;
+    bool mSeeking;
+    int64_t mIODeadline;
     MediaSource::ReadOptions::SeekMode mSeekMode;
+    int mSeekFlags;
     int64_t mSeekPos;
+    int64_t mSeekTimeUs;
     int64_t mSeekMin;
     int64_t mSeekMax;
 
     int mReadPauseReturn;
+    int mPeakQueuedSize;
     PacketQueue mAudioQ;
     PacketQueue mVideoQ;
     bool mVideoEOSReceived;
     bool mAudioEOSReceived;
+    bool mVideoStopped;
+    bool mAudioStopped;
 
     bool mFFmpegInited;
     AVFormatContext *mFormatCtx;
@@ -105,11 +141,20 @@ private:
     bool mDefersToCreateAudioTrack;
     AVBitStreamFilterContext *mVideoBsfc;
     AVBitStreamFilterContext *mAudioBsfc;
+    bool mAudioStripADTS;
+
+    bool mThumbnailMode;
+    bool mPullMode;
+    int mPullStreamIdx;
+    bool mLiveMode;
 
     static int decode_interrupt_cb(void *ctx);
+    void setIODeadline(int64_t timeoutUs);
     int initStreams();
     void deInitStreams();
     void fetchStuffsFromSniffedMeta(const sp<AMessage> &meta);
+    static bool isLiveUrl(const char *url);
+    void drop_late_packets();
     void setFFmpegDefaultOpts();
     void printTime(int64_t time);
     bool is_codec_supported(enum AVCodecID codec_id);
@@ -120,8 +165,15 @@ private:
     void stream_component_close(int stream_index);
     void reachedEOS(enum AVMediaType media_type);
     int stream_seek(int64_t pos, enum AVMediaType media_type,
-            MediaSource::ReadOptions::SeekMode mode);
+            MediaSource::ReadOptions::SeekMode mode, int *serial);
+    int64_t seek_byte_pos(AVStream *st, int64_t ts, int64_t timeUs);
+    void estimate_duration();
     int check_extradata(AVCodecContext *avctx);
+    bool isPullStream(int stream_index);
+    bool setStreamStopped(int stream_index, bool stopped);
+    bool filter_audio_packet(AVPacket *pkt);
+    int pull_read(int stream_index, int64_t seekTimeUs,
+            MediaSource::ReadOptions::SeekMode mode, AVPacket *pkt);
 
     bool mReaderThreadStarted;
     pthread_t mReaderThread;
@@ -129,6 +181,8 @@ private:
     void stopReaderThread();
     static void *ReaderWrapper(void *me);
     void readerEntry();
+    int queue_packet(AVPacket *pkt);
+    int probe_deferred_tracks();
 
     DISALLOW_EVIL_CONSTRUCTORS(FFmpegExtractor);
 };
@@ -137,6 +191,9 @@ bool SniffFFMPEG(
         const sp<DataSource> &source, String8 *mimeType, float *confidence,
         sp<AMessage> *);
 
+MediaExtractor *CreateFFmpegExtractor(const sp<DataSource> &source,
+        const char *mime, const sp<AMessage> &meta);
+
 }  // namespace android
 
 #endif  // SUPER_EXTRACTOR_H_
@@ -1014,7 +1014,8 @@ int32_t SoftFFmpegAudio::openDecoder() {
            avcodec_get_name(mCtx->codec_id),
            mCtx->sample_rate, mCtx->channels);
 
-    int err = avcodec_open2(mCtx, mCtx->codec, NULL);
+    int err = open_codec_with_thread_policy(mCtx, mCtx->codec,
+            THREAD_ROLE_AUDIO_DECODER);
     if (err < 0) {
         ALOGE("ffmpeg audio decoder failed to initialize.(%s)", av_err2str(err));
         return ERR_DECODER_OPEN_FAILED;
@@ -421,7 +421,8 @@ int32_t SoftFFmpegVideo::openDecoder() {
     ALOGD("begin to open ffmpeg decoder(%s) now",
             avcodec_get_name(mCtx->codec_id));
 
-    int err = avcodec_open2(mCtx, mCtx->codec, NULL);
+    int err = open_codec_with_thread_policy(mCtx, mCtx->codec,
+            THREAD_ROLE_VIDEO_DECODER);
     if (err < 0) {
         ALOGE("ffmpeg video decoder failed to initialize. (%s)", av_err2str(err));
         return ERR_DECODER_OPEN_FAILED;
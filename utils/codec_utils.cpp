@@ -272,12 +272,78 @@ sp<MetaData> setFLV1Format(AVCodecContext *avctx)
     return meta;
 }
 
+// HEVC bitstream without start codes, convert the parameter sets of the
+// hvcC to annex b as the packets are.
+static sp<ABuffer> convertHVCC2AnnexB(const uint8_t *data, size_t size)
+{
+    size_t pass, i, j, numArrays, numNalus, len, pos, outSize = 0;
+    sp<ABuffer> csd;
+
+    if (size < 23) {
+        return NULL;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        numArrays = data[22];
+        pos = 23;
+        for (i = 0; i < numArrays; i++) {
+            if (pos + 3 > size) {
+                return NULL;
+            }
+            numNalus = (data[pos + 1] << 8) | data[pos + 2];
+            pos += 3;
+            for (j = 0; j < numNalus; j++) {
+                if (pos + 2 > size) {
+                    return NULL;
+                }
+                len = (data[pos] << 8) | data[pos + 1];
+                pos += 2;
+                if (pos + len > size) {
+                    return NULL;
+                }
+                if (pass == 0) {
+                    outSize += 4 + len;
+                } else {
+                    uint8_t *dst = csd->data() + csd->size();
+                    dst[0] = 0;
+                    dst[1] = 0;
+                    dst[2] = 0;
+                    dst[3] = 1;
+                    memcpy(dst + 4, data + pos, len);
+                    csd->setRange(0, csd->size() + 4 + len);
+                }
+                pos += len;
+            }
+        }
+        if (pass == 0) {
+            if (outSize == 0) {
+                return NULL;
+            }
+            csd = new ABuffer(outSize);
+            csd->setRange(0, 0);
+        }
+    }
+
+    return csd;
+}
+
 sp<MetaData> setHEVCFormat(AVCodecContext *avctx)
 {
     ALOGV("HEVC");
 
     sp<MetaData> meta = new MetaData;
     meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_VIDEO_HEVC);
+
+    // the codec config is annex b only when FFmpegSource converts the
+    // NALs of the packets as well
+    if (getHVCCNalLengthSize(avctx)) {
+        sp<ABuffer> csd = convertHVCC2AnnexB(avctx->extradata, avctx->extradata_size);
+        if (csd != NULL) {
+            meta->setData(kKeyRawCodecSpecificData, 0, csd->data(), csd->size());
+            return meta;
+        }
+        ALOGW("malformed hvcC, pass it as is");
+    }
     meta->setData(kKeyRawCodecSpecificData, 0, avctx->extradata, avctx->extradata_size);
 
     return meta;
@@ -482,6 +548,25 @@ sp<MetaData> setFLACFormat(AVCodecContext *avctx)
     return meta;
 }
 
+// HEVC extradata is a hvcC rather than annex b parameter sets
+bool isHVCC(AVCodecContext *avctx)
+{
+    return avctx->codec_id == AV_CODEC_ID_HEVC
+        && avctx->extradata_size > 22
+        && (avctx->extradata[0] || avctx->extradata[1] || avctx->extradata[2] > 1);
+}
+
+size_t getHVCCNalLengthSize(AVCodecContext *avctx)
+{
+    size_t nalLengthSize;
+
+    if (!isHVCC(avctx)) {
+        return 0;
+    }
+    nalLengthSize = 1 + (avctx->extradata[21] & 3);
+    return nalLengthSize == 3 || nalLengthSize == 4 ? nalLengthSize : 0;
+}
+
 //Convert H.264 NAL format to annex b
 status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         uint8_t *src, size_t src_size, size_t nal_len_size)
@@ -518,5 +603,27 @@ status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
     return status;
 }
 
+//Convert 4 byte length prefixed NALs to annex b in place
+status_t convertNal2AnnexBInPlace(uint8_t *data, size_t size)
+{
+    size_t nal_len = 0;
+
+    while (size >= 4) {
+        nal_len = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+        if (nal_len > INT_MAX || nal_len > size - 4) {
+            return ERROR_MALFORMED;
+        }
+        data[0] = 0;
+        data[1] = 0;
+        data[2] = 0;
+        data[3] = 1;
+
+        data += 4 + nal_len;
+        size -= 4 + nal_len;
+    }
+
+    return OK;
+}
+
 }  // namespace android
 
@@ -60,9 +60,17 @@ sp<MetaData> setAPEFormat(AVCodecContext *avctx);
 sp<MetaData> setDTSFormat(AVCodecContext *avctx);
 sp<MetaData> setFLACFormat(AVCodecContext *avctx);
 
+// HEVC extradata is a hvcC rather than annex b parameter sets
+bool isHVCC(AVCodecContext *avctx);
+// NAL length size of a hvcC stream whose NALs convertNal2AnnexB can turn
+// into annex b (3 or 4), 0 if the stream has to be passed as is
+size_t getHVCCNalLengthSize(AVCodecContext *avctx);
+
 //Convert H.264 NAL format to annex b
 status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         uint8_t *src, size_t src_size, size_t nal_len_size);
+//Convert 4 byte length prefixed NALs to annex b in place
+status_t convertNal2AnnexBInPlace(uint8_t *data, size_t size);
 
 }  // namespace android
 
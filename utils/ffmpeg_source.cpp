@@ -33,12 +33,15 @@ extern "C" {
 }
 #endif
 
+// the largest single readAt, so a pending interrupt is noticed between chunks
+#define FFSOURCE_READ_CHUNK_SIZE (64 * 1024)
+
 namespace android {
 
 class FFSource
 {
 public:
-    FFSource(DataSource *source);
+    FFSource(DataSource *source, AVIOInterruptCB *int_cb);
     int init_check();
     int read(unsigned char *buf, size_t size);
     int64_t seek(int64_t pos);
@@ -47,11 +50,13 @@ public:
 protected:
     sp<DataSource> mSource;
     int64_t mOffset;
+    AVIOInterruptCB *mInterruptCB;
 };
 
-FFSource::FFSource(DataSource *source)
+FFSource::FFSource(DataSource *source, AVIOInterruptCB *int_cb)
     : mSource(source),
-      mOffset(0)
+      mOffset(0),
+      mInterruptCB(int_cb)
 {
 }
 
@@ -73,17 +78,36 @@ int FFSource::init_check()
 int FFSource::read(unsigned char *buf, size_t size)
 {
     ssize_t n = 0;
+    size_t total = 0;
+
+    while (total < size) {
+        // ff_check_interrupt is not exported from shared libavformat
+        if (mInterruptCB && mInterruptCB->callback
+                && mInterruptCB->callback(mInterruptCB->opaque)) {
+            ALOGV("FFSource read interrupted");
+            return total > 0 ? (int)total : AVERROR_EXIT;
+        }
 
-    n = mSource->readAt(mOffset, buf, size);
-    if (n == UNKNOWN_ERROR) {
-        ALOGE("FFSource readAt failed");
-        return AVERROR(errno);
-    }
-    if (n > 0) {
+        size_t chunk = size - total;
+        if (chunk > FFSOURCE_READ_CHUNK_SIZE)
+            chunk = FFSOURCE_READ_CHUNK_SIZE;
+
+        n = mSource->readAt(mOffset, buf + total, chunk);
+        if (n == UNKNOWN_ERROR) {
+            ALOGE("FFSource readAt failed");
+            return total > 0 ? (int)total : AVERROR(errno);
+        }
+        if (n <= 0) {
+            break;
+        }
         mOffset += n;
+        total += n;
+        if ((size_t)n < chunk) {
+            break;
+        }
     }
 
-    return n;
+    return total > 0 ? (int)total : n;
 }
 
 int64_t FFSource::seek(int64_t pos)
@@ -149,7 +173,7 @@ static int android_open(URLContext *h, const char *url, int flags __unused)
 
     ALOGV("ffmpeg open android data source success, source ptr: %p", source);
 
-    FFSource *ffs = new FFSource(source);
+    FFSource *ffs = new FFSource(source, &h->interrupt_callback);
     h->priv_data = (void *)ffs;
 
     ALOGV("android source open success");
@@ -41,7 +41,18 @@ extern "C" {
 }
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
 #include <cutils/properties.h>
+#include <utils/AndroidThreads.h>
 
 #include "ffmpeg_utils.h"
 #include "ffmpeg_source.h"
@@ -274,39 +285,115 @@ void deInitFFmpeg()
 //////////////////////////////////////////////////////////////////////////////////
 // parser
 //////////////////////////////////////////////////////////////////////////////////
+/* return the first 00 00 01 start code in [p, end), or end if there is
+ * none. Only the zero bytes are candidates, so look for them a block at a
+ * time and check the few positions that have one.
+ */
+static const uint8_t *scan_start_code(const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *last = end - 3; /* last position a start code fits at */
+
+    if (end - p < 3)
+        return end;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    while (p + 16 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        while (mask) {
+            const uint8_t *q = p + __builtin_ctz(mask);
+            if (q > last)
+                return end;
+            if (q[1] == 0 && q[2] == 1)
+                return q;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const uint8x16_t zero = vdupq_n_u8(0);
+    while (p + 16 <= end) {
+        uint64x2_t m = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(p), zero));
+        if (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1)) {
+            const uint8_t *q;
+            for (q = p; q < p + 16 && q <= last; q++) {
+                if (q[0] == 0 && q[1] == 0 && q[2] == 1)
+                    return q;
+            }
+        }
+        p += 16;
+    }
+#else
+    /* a word at a time, as long as it has no zero byte */
+    for (; p <= last && ((intptr_t)p & 3); p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    while (p + 4 <= end) {
+        uint32_t x = *(const uint32_t *)p;
+        if ((x - 0x01010101) & (~x) & 0x80808080) {
+            const uint8_t *q;
+            for (q = p; q < p + 4 && q <= last; q++) {
+                if (q[0] == 0 && q[1] == 0 && q[2] == 1)
+                    return q;
+            }
+        }
+        p += 4;
+    }
+#endif
+
+    for (; p <= last; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    return end;
+}
+
+/* like scan_start_code, and describe the unit found in *sc: where it
+ * starts, leading zeros from p on included, and its type byte */
+const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end, StartCode *sc)
+{
+    const uint8_t *q = scan_start_code(p, end);
+
+    if (q < end) {
+        sc->unit = q;
+        while (sc->unit > p && sc->unit[-1] == 0)
+            sc->unit--;
+        sc->header = q + 3 < end ? q[3] : -1;
+    } else {
+        sc->unit = end;
+        sc->header = -1;
+    }
+    return q;
+}
+
 /* H.264 bitstream with start codes, NOT AVC1! */
 static int h264_split(AVCodecContext *avctx __unused,
         const uint8_t *buf, int buf_size, int check_compatible_only)
 {
-    int i;
-    uint32_t state = -1;
+    const uint8_t *end = buf + buf_size;
+    StartCode sc;
+    const uint8_t *p = find_start_code(buf, end, &sc);
     int has_sps= 0;
     int has_pps= 0;
 
     //av_hex_dump(stderr, buf, 100);
 
-    for(i=0; i<=buf_size; i++){
-        if((state&0xFFFFFF1F) == 0x107) {
+    for (; sc.header >= 0; p = find_start_code(p + 3, end, &sc)) {
+        int nal_type = sc.header & 0x1F;
+        if (nal_type == 7) {
             ALOGI("found NAL_SPS");
             has_sps=1;
-        }
-        if((state&0xFFFFFF1F) == 0x108) {
+        } else if (nal_type == 8) {
             ALOGI("found NAL_PPS");
             has_pps=1;
             if (check_compatible_only)
                 return (has_sps & has_pps);
+        } else if (nal_type == 1 || nal_type == 2 || nal_type == 5) {
+            if(has_pps)
+                return sc.unit - buf;
         }
-        if((state&0xFFFFFF00) == 0x100
-                && ((state&0xFFFFFF1F) == 0x101
-                    || (state&0xFFFFFF1F) == 0x102
-                    || (state&0xFFFFFF1F) == 0x105)){
-            if(has_pps){
-                while(i>4 && buf[i-5]==0) i--;
-                return i-4;
-            }
-        }
-        if (i<buf_size)
-            state= (state<<8) | buf[i];
     }
     return 0;
 }
@@ -314,16 +401,90 @@ static int h264_split(AVCodecContext *avctx __unused,
 static int mpegvideo_split(AVCodecContext *avctx __unused,
         const uint8_t *buf, int buf_size, int check_compatible_only __unused)
 {
-    int i;
-    uint32_t state= -1;
+    const uint8_t *end = buf + buf_size;
+    StartCode sc;
+    const uint8_t *p = find_start_code(buf, end, &sc);
+    int found=0;
+
+    for (; sc.header >= 0; p = find_start_code(p + 3, end, &sc)) {
+        if(sc.header == 0xB3){
+            found=1;
+        }else if(found && sc.header != 0xB5)
+            return p - buf;
+    }
+    return 0;
+}
+
+/* HEVC bitstream with start codes, NOT hvcC! */
+static int hevc_split(AVCodecContext *avctx __unused,
+        const uint8_t *buf, int buf_size, int check_compatible_only)
+{
+    const uint8_t *end = buf + buf_size;
+    StartCode sc;
+    const uint8_t *p = find_start_code(buf, end, &sc);
+    int has_vps = 0;
+    int has_sps = 0;
+    int has_pps = 0;
+
+    for (; sc.header >= 0; p = find_start_code(p + 3, end, &sc)) {
+        int nal_type = (sc.header >> 1) & 0x3F;
+        if (nal_type == 32) {
+            ALOGI("found NAL_VPS");
+            has_vps=1;
+        } else if (nal_type == 33) {
+            ALOGI("found NAL_SPS");
+            has_sps=1;
+        } else if (nal_type == 34) {
+            ALOGI("found NAL_PPS");
+            has_pps=1;
+            if (check_compatible_only && has_vps && has_sps)
+                return 1;
+        } else if (nal_type < 32) { /* VCL */
+            if(has_vps && has_sps && has_pps)
+                return sc.unit - buf;
+        }
+    }
+    return 0;
+}
+
+/* VC-1 advanced profile, split after the sequence and entry-point headers */
+static int vc1_split(AVCodecContext *avctx __unused,
+        const uint8_t *buf, int buf_size, int check_compatible_only __unused)
+{
+    const uint8_t *end = buf + buf_size;
+    StartCode sc;
+    const uint8_t *p = find_start_code(buf, end, &sc);
+    int has_seqhdr=0;
+    int has_entrypoint=0;
+
+    for (; sc.header >= 0; p = find_start_code(p + 3, end, &sc)) {
+        if(sc.header == 0x0F){ /* sequence header */
+            has_seqhdr=1;
+        }else if(sc.header == 0x0E){ /* entry-point header */
+            has_entrypoint=1;
+        }else if(sc.header >= 0x1B && sc.header <= 0x1F){
+            /* user data, keep it with the headers */
+        }else if(has_seqhdr && has_entrypoint){
+            return p - buf;
+        }
+    }
+    return 0;
+}
+
+/* MPEG-4 part 2, split after the VOL header */
+static int mpeg4video_split(AVCodecContext *avctx __unused,
+        const uint8_t *buf, int buf_size, int check_compatible_only __unused)
+{
+    const uint8_t *end = buf + buf_size;
+    StartCode sc;
+    const uint8_t *p = find_start_code(buf, end, &sc);
     int found=0;
 
-    for(i=0; i<buf_size; i++){
-        state= (state<<8) | buf[i];
-        if(state == 0x1B3){
+    for (; sc.header >= 0; p = find_start_code(p + 3, end, &sc)) {
+        if(sc.header >= 0x20 && sc.header <= 0x2F){ /* video_object_layer_start_code */
             found=1;
-        }else if(found && state != 0x1B5 && state < 0x200 && state >= 0x100)
-            return i-3;
+        }else if(found && (sc.header == 0xB3 || sc.header == 0xB6)) /* GOV or VOP */
+            return p - buf;
     }
     return 0;
 }
@@ -339,9 +500,15 @@ int parser_split(AVCodecContext *avctx,
 
     if (avctx->codec_id == AV_CODEC_ID_H264) {
         return h264_split(avctx, buf, buf_size, 0);
-    } else if (avctx->codec_id == AV_CODEC_ID_MPEG2VIDEO ||
-            avctx->codec_id == AV_CODEC_ID_MPEG4) {
+    } else if (avctx->codec_id == AV_CODEC_ID_HEVC) {
+        return hevc_split(avctx, buf, buf_size, 0);
+    } else if (avctx->codec_id == AV_CODEC_ID_MPEG1VIDEO ||
+            avctx->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
         return mpegvideo_split(avctx, buf, buf_size, 0);
+    } else if (avctx->codec_id == AV_CODEC_ID_MPEG4) {
+        return mpeg4video_split(avctx, buf, buf_size, 0);
+    } else if (avctx->codec_id == AV_CODEC_ID_VC1) {
+        return vc1_split(avctx, buf, buf_size, 0);
     } else {
         ALOGE("parser split, unsupport the codec, id: 0x%0x", avctx->codec_id);
     }
@@ -362,6 +529,13 @@ int is_extradata_compatible_with_android(AVCodecContext *avctx)
         // SPS + PPS
         return !!(h264_split(avctx, avctx->extradata,
                     avctx->extradata_size, 1) > 0);
+    } else if (avctx->codec_id == AV_CODEC_ID_HEVC
+            && avctx->extradata_size > 3
+            && !avctx->extradata[0] && !avctx->extradata[1]
+            && avctx->extradata[2] <= 1 /* not hvcC */) {
+        // VPS + SPS + PPS
+        return !!(hevc_split(avctx, avctx->extradata,
+                    avctx->extradata_size, 1) > 0);
     } else {
         // default, FIXME
         return !!(avctx->extradata_size > 0);
@@ -390,7 +564,7 @@ void packet_queue_destroy(PacketQueue *q)
 
 void packet_queue_flush(PacketQueue *q)
 {
-    AVPacketList *pkt, *pkt1;
+    MyAVPacketList *pkt, *pkt1;
 
     pthread_mutex_lock(&q->mutex);
     for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
@@ -418,16 +592,19 @@ void packet_queue_abort(PacketQueue *q)
 
 static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
 {
-    AVPacketList *pkt1;
+    MyAVPacketList *pkt1;
 
     if (q->abort_request)
         return -1;
 
-    pkt1 = (AVPacketList *)av_malloc(sizeof(AVPacketList));
+    pkt1 = (MyAVPacketList *)av_malloc(sizeof(MyAVPacketList));
     if (!pkt1)
         return -1;
     pkt1->pkt = *pkt;
     pkt1->next = NULL;
+    if (pkt == &q->flush_pkt)
+        q->serial++;
+    pkt1->serial = q->serial;
 
     if (!q->last_pkt)
         q->first_pkt = pkt1;
@@ -471,9 +648,9 @@ int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
 
 /* packet queue handling */
 /* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
-int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
 {
-    AVPacketList *pkt1;
+    MyAVPacketList *pkt1;
     int ret;
 
     pthread_mutex_lock(&q->mutex);
@@ -493,6 +670,8 @@ int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
             //q->size -= pkt1->pkt.size + sizeof(*pkt1);
             q->size -= pkt1->pkt.size;
             *pkt = pkt1->pkt;
+            if (serial)
+                *serial = pkt1->serial;
             av_free(pkt1);
             ret = 1;
             break;
@@ -507,6 +686,60 @@ int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
     return ret;
 }
 
+static int64_t packet_ts(const AVPacket *pkt)
+{
+    return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+}
+
+/* drop packets from the head until the queue spans at most max_span in
+ * the time base of its stream. With key_only set the queue is only cut
+ * in front of its newest keyframe. Flush and eos packets are never
+ * dropped. Return the number of packets dropped.
+ */
+int packet_queue_drop_head(PacketQueue *q, int64_t max_span, int key_only)
+{
+    MyAVPacketList *pkt1, *cut = NULL;
+    int64_t last_ts;
+    int dropped = 0;
+
+    pthread_mutex_lock(&q->mutex);
+
+    if (!q->last_pkt || (last_ts = packet_ts(&q->last_pkt->pkt)) == AV_NOPTS_VALUE) {
+        pthread_mutex_unlock(&q->mutex);
+        return 0;
+    }
+
+    for (pkt1 = q->first_pkt; pkt1; pkt1 = pkt1->next) {
+        AVPacket *pkt = &pkt1->pkt;
+        if (pkt->data == q->flush_pkt.data || !pkt->data)
+            break;
+        if (key_only) {
+            if (pkt1 != q->first_pkt && (pkt->flags & AV_PKT_FLAG_KEY))
+                cut = pkt1;
+        } else if (packet_ts(pkt) != AV_NOPTS_VALUE
+                && last_ts - packet_ts(pkt) <= max_span) {
+            cut = pkt1;
+            break;
+        }
+    }
+
+    if (cut && packet_ts(&q->first_pkt->pkt) != AV_NOPTS_VALUE
+            && last_ts - packet_ts(&q->first_pkt->pkt) > max_span) {
+        while (q->first_pkt != cut) {
+            pkt1 = q->first_pkt;
+            q->first_pkt = pkt1->next;
+            q->nb_packets--;
+            q->size -= pkt1->pkt.size;
+            av_free_packet(&pkt1->pkt);
+            av_free(pkt1);
+            dropped++;
+        }
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+    return dropped;
+}
+
 void packet_queue_start(PacketQueue *q)
 {
     pthread_mutex_lock(&q->mutex);
@@ -549,6 +782,351 @@ bool setup_vorbis_extradata(uint8_t **extradata, int *extradata_size,
     return true;
 }
 
+/* the size of the ADTS header at buf, 0 if there is none */
+int adts_header_size(const uint8_t *buf, int size)
+{
+    if (size < 7 || buf[0] != 0xff || (buf[1] & 0xf6) != 0xf0) {
+        return 0;
+    }
+    // protection_absent, else a CRC follows
+    return (buf[1] & 0x01) ? 7 : 9;
+}
+
+/* build the AudioSpecificConfig of an ADTS stream from the header of its
+ * first frame. Channel layouts carried in a PCE are left to aac_adtstoasc.
+ */
+bool setup_aac_extradata(uint8_t **extradata, int *extradata_size,
+        const uint8_t *adts, int adts_size)
+{
+    int object_type = 0;
+    int sf_index = 0;
+    int channel_config = 0;
+    uint8_t *p = NULL;
+
+    if (adts_header_size(adts, adts_size) == 0) {
+        return false;
+    }
+
+    // the ADTS profile is the MPEG-4 audio object type minus one
+    object_type = (adts[2] >> 6) + 1;
+    sf_index = (adts[2] >> 2) & 0x0f;
+    channel_config = ((adts[2] & 0x01) << 2) | (adts[3] >> 6);
+    if (sf_index > 12 || channel_config == 0) {
+        return false;
+    }
+
+    p = *extradata = (uint8_t *)av_mallocz(2 + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (!p) {
+        ALOGE("oom for aac extradata");
+        return false;
+    }
+
+    // oooo offf fccc c000
+    p[0] = (object_type << 3) | (sf_index >> 1);
+    p[1] = ((sf_index & 1) << 7) | (channel_config << 3);
+    *extradata_size = 2;
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// duration
+//////////////////////////////////////////////////////////////////////////////////
+static int ts_find_sync(const uint8_t *buf, int size, int *packet_size)
+{
+    static const int sizes[] = {188, 192, 204};
+    int i, j;
+
+    for (j = 0; j < (int)FF_ARRAY_ELEMS(sizes); j++) {
+        int ps = sizes[j];
+        int prefix = ps == 192 ? 4 : 0;
+        for (i = prefix; i + 2 * ps < size; i++) {
+            if (buf[i] == 0x47 && buf[i + ps] == 0x47 && buf[i + 2 * ps] == 0x47) {
+                *packet_size = ps;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/* the first (last set) PCR base of pid in a window of TS packets, any pid
+ * if *pid < 0. Return -1 if there is none.
+ */
+static int64_t ts_scan_pcr(const uint8_t *buf, int size, int *pid, int last)
+{
+    int packet_size = 0;
+    int i = ts_find_sync(buf, size, &packet_size);
+    int64_t pcr = -1;
+
+    if (i < 0)
+        return -1;
+
+    for (; i + 188 <= size; i += packet_size) {
+        const uint8_t *p = buf + i;
+        int p_pid;
+        if (p[0] != 0x47)
+            continue;
+        p_pid = ((p[1] & 0x1F) << 8) | p[2];
+        if (!(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+            continue; /* no adaptation field with a PCR */
+        if (*pid >= 0 && p_pid != *pid)
+            continue;
+        *pid = p_pid;
+        pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+        if (!last)
+            break;
+    }
+    return pcr;
+}
+
+/* duration of a transport stream from the first PCR of the head window
+ * and the last one of the tail window, -1 if unknown
+ */
+int64_t ts_duration_from_pcr(const uint8_t *head, int head_size,
+        const uint8_t *tail, int tail_size)
+{
+    int pid = -1;
+    int64_t first, last;
+
+    first = ts_scan_pcr(head, head_size, &pid, 0);
+    if (first < 0)
+        return -1;
+    last = ts_scan_pcr(tail, tail_size, &pid, 1);
+    if (last < 0)
+        return -1;
+
+    /* the 33 bit PCR base may have wrapped once */
+    return av_rescale((last - first) & ((1LL << 33) - 1), 1000000, 90000);
+}
+
+/* the last granule position of the ogg logical stream whose first page
+ * carries codec_magic, -1 if unknown
+ */
+int64_t ogg_last_granule(const uint8_t *head, int head_size,
+        const uint8_t *tail, int tail_size,
+        const char *codec_magic, int codec_magic_size)
+{
+    uint32_t serial = 0;
+    int64_t granule = -1;
+    int found = 0;
+    int i;
+
+    /* the BOS pages come first, one per logical stream */
+    for (i = 0; i + 27 < head_size; i++) {
+        const uint8_t *p = head + i;
+        int payload;
+        if (memcmp(p, "OggS", 4) || p[4] != 0)
+            continue;
+        if (!(p[5] & 0x02))
+            break; /* past the BOS pages */
+        payload = 27 + p[26];
+        if (i + payload + codec_magic_size <= head_size
+                && !memcmp(p + payload, codec_magic, codec_magic_size)) {
+            serial = AV_RL32(p + 14);
+            found = 1;
+            break;
+        }
+    }
+    if (!found)
+        return -1;
+
+    for (i = 0; i + 27 <= tail_size; i++) {
+        const uint8_t *p = tail + i;
+        if (memcmp(p, "OggS", 4) || p[4] != 0 || AV_RL32(p + 14) != serial)
+            continue;
+        if ((int64_t)AV_RL64(p + 6) >= 0)
+            granule = AV_RL64(p + 6);
+    }
+    return granule;
+}
+
+/* a MPEG audio layer III frame header, 0 if it is none */
+static int mp3_frame_header(const uint8_t *p, int *frame_size,
+        int *samples, int *sample_rate)
+{
+    static const int bitrates[2][15] = {
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+        {0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160},
+    };
+    static const int sample_rates[3] = {44100, 48000, 32000};
+    int version, lsf, bitrate_index, sr_index, padding, bitrate;
+
+    if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0)
+        return 0;
+    version = (p[1] >> 3) & 3; /* 0: 2.5, 2: 2, 3: 1 */
+    if (version == 1 || ((p[1] >> 1) & 3) != 1 /* layer III */)
+        return 0;
+    bitrate_index = p[2] >> 4;
+    sr_index = (p[2] >> 2) & 3;
+    if (bitrate_index == 0 || bitrate_index == 15 || sr_index == 3)
+        return 0;
+    padding = (p[2] >> 1) & 1;
+    lsf = version != 3;
+
+    bitrate = bitrates[lsf][bitrate_index] * 1000;
+    *sample_rate = sample_rates[sr_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    *samples = lsf ? 576 : 1152;
+    *frame_size = (lsf ? 72 : 144) * bitrate / *sample_rate + padding;
+    return 1;
+}
+
+/* walk the MP3 frames of a window, return the number of frames and add
+ * up their sizes. A run of frames only counts once 3 of them chain up.
+ */
+int mp3_frame_stats(const uint8_t *buf, int size, int64_t *bytes,
+        int *samples_per_frame, int *sample_rate)
+{
+    int i = 0, frames = 0;
+    int frame_size, samples, sr;
+
+    *bytes = 0;
+    while (i + 4 <= size) {
+        int j = i, chained = 0;
+        while (j + 4 <= size && mp3_frame_header(buf + j, &frame_size, &samples, &sr)
+                && chained < 3) {
+            j += frame_size;
+            chained++;
+        }
+        if (chained < 3) {
+            i++;
+            continue;
+        }
+        /* in sync, take the frames of this run */
+        while (i + 4 <= size && mp3_frame_header(buf + i, &frame_size, &samples, &sr)
+                && i + frame_size <= size) {
+            *bytes += frame_size;
+            *samples_per_frame = samples;
+            *sample_rate = sr;
+            frames++;
+            i += frame_size;
+        }
+        i++;
+    }
+    return frames;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// thread policy
+//////////////////////////////////////////////////////////////////////////////////
+/*
+ * Every thread this project creates takes its priority, cpu affinity and
+ * name from here. Each role can be tuned with properties, e.g. to keep the
+ * demuxer on the little cores and the decoders on the big ones:
+ *     setprop media.ffmpeg.reader.cpus 0x0f
+ *     setprop media.ffmpeg.vdec.cpus 0xf0
+ *     setprop media.ffmpeg.vdec.prio -4
+ *     setprop media.ffmpeg.vdec.threads 4
+ */
+static const struct {
+    const char *key;
+    const char *name;
+} thread_roles[THREAD_ROLE_NB] = {
+    { "reader",  "FFmpegExtractor Thread" },
+    { "vdec",    "FFmpegVdec" },
+    { "adec",    "FFmpegAdec" },
+};
+
+static bool get_role_property(ThreadRole role, const char *what,
+        char value[PROPERTY_VALUE_MAX])
+{
+    char key[PROPERTY_KEY_MAX];
+
+    snprintf(key, sizeof(key), "media.ffmpeg.%s.%s", thread_roles[role].key, what);
+    return property_get(key, value, NULL) > 0;
+}
+
+void get_thread_policy(ThreadRole role, int default_priority,
+        ThreadPolicy *policy)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    policy->name = thread_roles[role].name;
+    policy->priority = default_priority;
+    policy->cpu_mask = 0;
+    policy->thread_count = -1;
+
+    if (get_role_property(role, "prio", value)) {
+        policy->priority = atoi(value);
+    }
+    if (get_role_property(role, "cpus", value)) {
+        policy->cpu_mask = strtoull(value, NULL, 0);
+    }
+    if (get_role_property(role, "threads", value)) {
+        policy->thread_count = atoi(value);
+    }
+}
+
+static int set_cpu_mask(uint64_t mask)
+{
+    cpu_set_t set;
+    int cpu;
+
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++) {
+        if (mask & (1ULL << cpu))
+            CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+static void set_thread_policy(const ThreadPolicy *policy)
+{
+    androidSetThreadPriority(gettid(), policy->priority);
+    if (policy->cpu_mask && set_cpu_mask(policy->cpu_mask) < 0) {
+        ALOGW("%s: failed to set cpu mask 0x%" PRIx64 ": %s",
+                policy->name, policy->cpu_mask, strerror(errno));
+    }
+    prctl(PR_SET_NAME, (unsigned long)policy->name, 0, 0, 0);
+}
+
+/* apply the role's policy to the calling thread */
+void apply_thread_policy(ThreadRole role, int default_priority)
+{
+    ThreadPolicy policy;
+
+    get_thread_policy(role, default_priority, &policy);
+    ALOGV("%s: priority %d, cpus 0x%" PRIx64, policy.name,
+            policy.priority, policy.cpu_mask);
+    set_thread_policy(&policy);
+}
+
+/*
+ * libavcodec creates its frame and slice threads inside avcodec_open2 and
+ * they inherit priority, affinity and name from the opening thread, so the
+ * decoder role is applied around the open and the caller's own settings
+ * are put back afterwards.
+ */
+int open_codec_with_thread_policy(AVCodecContext *avctx, AVCodec *codec,
+        ThreadRole role)
+{
+    ThreadPolicy policy;
+    char old_name[16] = { 0 };
+    int old_priority = androidGetThreadPriority(gettid());
+    cpu_set_t old_set;
+    bool has_old_set;
+    int err;
+
+    get_thread_policy(role, old_priority, &policy);
+    if (policy.thread_count >= 0) {
+        avctx->thread_count = policy.thread_count;
+    }
+
+    prctl(PR_GET_NAME, (unsigned long)old_name, 0, 0, 0);
+    has_old_set = sched_getaffinity(0, sizeof(old_set), &old_set) == 0;
+
+    set_thread_policy(&policy);
+    err = avcodec_open2(avctx, codec, NULL);
+
+    androidSetThreadPriority(gettid(), old_priority);
+    if (policy.cpu_mask && has_old_set) {
+        sched_setaffinity(0, sizeof(old_set), &old_set);
+    }
+    prctl(PR_SET_NAME, (unsigned long)old_name, 0, 0, 0);
+
+    return err;
+}
+
 int64_t get_timestamp() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -41,6 +41,7 @@ extern "C" {
 #include "libavutil/parseutils.h"
 #include "libavutil/samplefmt.h"
 #include "libavutil/avassert.h"
+#include "libavutil/intreadwrite.h"
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
 #include "libswscale/swscale.h"
@@ -74,6 +75,12 @@ void deInitFFmpeg();
 //////////////////////////////////////////////////////////////////////////////////
 // parser
 //////////////////////////////////////////////////////////////////////////////////
+typedef struct StartCode {
+    const uint8_t *unit; /* where the unit starts, with all leading zeros */
+    int header;          /* the byte after 00 00 01, -1 at the end of buf */
+} StartCode;
+
+const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end, StartCode *sc);
 int is_extradata_compatible_with_android(AVCodecContext *avctx);
 int parser_split(AVCodecContext *avctx, const uint8_t *buf, int buf_size);
 
@@ -81,12 +88,19 @@ int parser_split(AVCodecContext *avctx, const uint8_t *buf, int buf_size);
 // packet queue
 //////////////////////////////////////////////////////////////////////////////////
 
+typedef struct MyAVPacketList {
+    AVPacket pkt;
+    struct MyAVPacketList *next;
+    int serial;
+} MyAVPacketList;
+
 typedef struct PacketQueue {
     AVPacket flush_pkt;
-    AVPacketList *first_pkt, *last_pkt;
+    MyAVPacketList *first_pkt, *last_pkt;
     int nb_packets;
     int size;
     int abort_request;
+    int serial; /* bumped each time flush_pkt is queued */
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 } PacketQueue;
@@ -98,13 +112,51 @@ void packet_queue_start(PacketQueue *q);
 void packet_queue_abort(PacketQueue *q);
 int packet_queue_put(PacketQueue *q, AVPacket *pkt);
 int packet_queue_put_nullpacket(PacketQueue *q, int stream_index);
-int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block);
+int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial);
+int packet_queue_drop_head(PacketQueue *q, int64_t max_span, int key_only);
 
 //////////////////////////////////////////////////////////////////////////////////
 // misc
 //////////////////////////////////////////////////////////////////////////////////
 bool setup_vorbis_extradata(uint8_t **extradata, int *extradata_size,
         const uint8_t *header_start[3], const int header_len[3]);
+int adts_header_size(const uint8_t *buf, int size);
+bool setup_aac_extradata(uint8_t **extradata, int *extradata_size,
+        const uint8_t *adts, int adts_size);
+
+//////////////////////////////////////////////////////////////////////////////////
+// duration
+//////////////////////////////////////////////////////////////////////////////////
+int64_t ts_duration_from_pcr(const uint8_t *head, int head_size,
+        const uint8_t *tail, int tail_size);
+int64_t ogg_last_granule(const uint8_t *head, int head_size,
+        const uint8_t *tail, int tail_size,
+        const char *codec_magic, int codec_magic_size);
+int mp3_frame_stats(const uint8_t *buf, int size, int64_t *bytes,
+        int *samples_per_frame, int *sample_rate);
+
+//////////////////////////////////////////////////////////////////////////////////
+// thread policy
+//////////////////////////////////////////////////////////////////////////////////
+enum ThreadRole {
+    THREAD_ROLE_READER,
+    THREAD_ROLE_VIDEO_DECODER,
+    THREAD_ROLE_AUDIO_DECODER,
+    THREAD_ROLE_NB,
+};
+
+typedef struct ThreadPolicy {
+    const char *name;
+    int priority;
+    uint64_t cpu_mask;  /* 0: inherited */
+    int thread_count;   /* decoders only, -1: left to the caller */
+} ThreadPolicy;
+
+void get_thread_policy(ThreadRole role, int default_priority,
+        ThreadPolicy *policy);
+void apply_thread_policy(ThreadRole role, int default_priority);
+int open_codec_with_thread_policy(AVCodecContext *avctx, AVCodec *codec,
+        ThreadRole role);
 
 int64_t get_timestamp(void);
 